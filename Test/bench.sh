@@ -0,0 +1,55 @@
+#!/bin/bash
+# Times the hash and the sort engine of bin/sequniq on generated inputs of
+# growing size; run with `make bench`. The reads are 100 bp with random
+# qualities, about 30% of them duplicates.
+#
+#   SIZES    numbers of reads to sweep (default: 250000 1000000 4000000)
+#   THREADS  -t for both engines (default: 1)
+#   GZ=1     compress the inputs, which the hash engine has to seek in
+#   SEQUNIQ  binary to time (default: bin/sequniq)
+#   TMPDIR   where the inputs go; the largest default one takes 850 MB
+
+SEQUNIQ=${SEQUNIQ:-bin/sequniq}
+SIZES=${SIZES:-250000 1000000 4000000}
+THREADS=${THREADS:-1}
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/sequniq-bench.XXXXXX")
+trap 'rm -rf "$TMP"' EXIT
+TIMEFORMAT=%R
+
+# runs sequniq with the given options, prints the seconds it took and leaves
+# the sorted output's checksum in $TMP/sum
+run () {
+    { time "$SEQUNIQ" "$@" > "$TMP/out.fq"; } 2>&1
+    sort "$TMP/out.fq" | cksum > "$TMP/sum"
+}
+
+printf "%10s %8s %10s %10s\n" reads MB "hash (s)" "sort (s)"
+for n in $SIZES; do
+    input="$TMP/in.fq"
+    awk -v n=$n 'BEGIN {
+        srand(n);
+        split("A C G T", base, " ");
+        for (i = 0; i < n; i++) {
+            s = int(rand() * n * 0.7); seq = "";
+            for (j = 0; j < 100; j++) { seq = seq base[s % 4 + 1]; s = int(s / 4) + j * 7919 }
+            qual = "";
+            for (j = 0; j < 100; j++) qual = qual sprintf("%c", 35 + int(rand() * 40));
+            printf "@r%d\n%s\n+\n%s\n", i, seq, qual;
+        }
+    }' > "$input"
+    if [ "$GZ" = 1 ]; then
+        gzip -1 "$input"
+        input="$input.gz"
+    fi
+    mb=$(( $(wc -c < "$input") / 1000000 ))
+
+    hash=$(run -e hash -t $THREADS "$input")
+    hashsum=$(cat "$TMP/sum")
+    sort=$(run -e sort -t $THREADS "$input")
+    if [ "$(cat "$TMP/sum")" != "$hashsum" ]; then
+        echo "ERROR: the engines kept different reads of $n" >&2
+        exit 1
+    fi
+    printf "%10d %8d %10s %10s\n" $n $mb $hash $sort
+    rm -f "$input"
+done
@@ -0,0 +1,132 @@
+#!/bin/sh
+# Regression checks for bin/sequniq; run with `make check`.
+
+SEQUNIQ=${SEQUNIQ:-bin/sequniq}
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/sequniq-check.XXXXXX")
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+check () {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+}
+
+# 200k reads of 1 in 100k sequences with random qualities, enough for the
+# sort engine to split the work between threads.
+awk 'BEGIN {
+    srand(42);
+    split("A C G T", base, " ");
+    for (i = 0; i < 200000; i++) {
+        s = int(rand() * 100000); seq = "";
+        for (j = 0; j < 50; j++) { seq = seq base[s % 4 + 1]; s = int(s / 4) + j * 7 }
+        qual = "";
+        for (j = 0; j < 50; j++) qual = qual sprintf("%c", 35 + int(rand() * 40));
+        printf "@r%d\n%s\n+\n%s\n", i, seq, qual;
+    }
+}' > "$TMP/in.fq"
+
+hash=$("$SEQUNIQ" -e hash "$TMP/in.fq" | sort | cksum)
+sort1=$("$SEQUNIQ" -e sort -t 1 "$TMP/in.fq" | sort | cksum)
+sort4=$("$SEQUNIQ" -e sort -t 4 "$TMP/in.fq" | sort | cksum)
+check "sort engine, 1 thread = hash engine" "$sort1" "$hash"
+check "sort engine, 4 threads = 1 thread" "$sort4" "$sort1"
+
+# --mark keeps every read and tags it with the number of reads with its
+# sequence, and all but one of them with DUP; the untagged ones are the reads
+# a plain run keeps. With --duplicates-out, the output and the duplicates
+# together are the input.
+records () { paste - - - - | sort | cksum; }
+for engine in hash sort; do
+    "$SEQUNIQ" -e $engine --mark "$TMP/in.fq" > "$TMP/marked.fq"
+    tags=$(awk 'NR % 4 == 1 { dup = $2 == "DUP"; set = $NF }
+        NR % 4 == 2 { n[$0]++; kept[$0] += !dup; if ($0 in size && size[$0] != set) bad = 1; size[$0] = set }
+        END {
+            for (s in n) if (size[s] != "dupset=" n[s] || kept[s] != 1) bad = 1;
+            print bad ? "wrong" : "right";
+        }' "$TMP/marked.fq")
+    check "--mark, $engine engine: dupset=N and DUP tags" "$tags" right
+    unmarked=$(awk 'NR % 4 == 1 { if ($2 == "DUP") skip = 4; else sub(/ dupset=[0-9]+$/, "") }
+        skip { skip--; next } { print }' "$TMP/marked.fq" | sort | cksum)
+    check "--mark, $engine engine: untagged reads = output" "$unmarked" "$hash"
+    "$SEQUNIQ" -e $engine --duplicates-out "$TMP/dups.fq" "$TMP/in.fq" > "$TMP/kept.fq"
+    check "--duplicates-out, $engine engine: output + duplicates = input" \
+        "$(cat "$TMP/kept.fq" "$TMP/dups.fq" | records)" "$(records < "$TMP/in.fq")"
+done
+
+# Keep-lists of a sharded run only apply to the input they were written for,
+# not to another file with as many reads.
+for i in 0 1; do "$SEQUNIQ" --shard $i/2 -p "$TMP/shard" "$TMP/in.fq"; done
+merged=$("$SEQUNIQ" --merge "$TMP/shard.0.keep" --merge "$TMP/shard.1.keep" "$TMP/in.fq" | sort | cksum)
+check "sharded run = hash engine" "$merged" "$hash"
+sed 's/^@r/@x/' "$TMP/in.fq" > "$TMP/other.fq"
+if "$SEQUNIQ" --merge "$TMP/shard.0.keep" --merge "$TMP/shard.1.keep" "$TMP/other.fq" > /dev/null 2>&1; then
+    check "keep-lists rejected for other input" merged rejected
+else
+    check "keep-lists rejected for other input" rejected rejected
+fi
+
+# Reads longer than the reader's blocks are stitched together across several
+# of them; the last one repeats the first. The output order is not part of
+# the check.
+awk 'BEGIN {
+    split("A C G T", base, " ");
+    for (i = 0; i < 3; i++) {
+        seq = ""; qual = "";
+        for (j = 0; j < 1000; j++) { seq = seq base[(i + j * j) % 4 + 1]; qual = qual "I" }
+        while (length(seq) < 3000000) { seq = seq seq; qual = qual qual }
+        read[i] = "@long" i "\n" seq "\n+\n" qual "\n";
+        printf "%s", read[i] > "'"$TMP/long_expected.fq"'";
+        printf "%s", read[i];
+    }
+    printf "%s", read[0];
+}' > "$TMP/long.fq"
+
+check "reads of 3 Mb" "$("$SEQUNIQ" "$TMP/long.fq" | sort | cksum)" "$(sort "$TMP/long_expected.fq" | cksum)"
+
+# Demultiplexing deduplicates each sample on its own: every sample's output
+# matches a plain run on the reads with its barcode. Every fourth read is
+# sample A with one mismatch in each index read, which only counts as A when
+# a mismatch is allowed per index.
+printf 'A ACGTAC+GGTTCA\nB TTGCAA+CAGTGT\n' > "$TMP/sheet.txt"
+awk 'NR % 4 == 1 {
+    split("ACGTAC+GGTTCA TTGCAA+CAGTGT ACTTAC+GGTACA GGGGGG+AAAAAA", index_, " ");
+    $0 = $0 " 1:N:0:" index_[(NR - 1) / 4 % 4 + 1];
+} { print }' "$TMP/in.fq" > "$TMP/demux.fq"
+sample_reads () {
+    awk -v pick="$1" 'NR % 4 == 1 { r = (NR - 1) / 4 % 4 } index(pick, r)' "$TMP/demux.fq" > "$TMP/sample.fq"
+    "$SEQUNIQ" "$TMP/sample.fq" | sort | cksum
+}
+for mismatches in 0 1; do
+    "$SEQUNIQ" --barcodes "$TMP/sheet.txt" --barcode-mismatches $mismatches -p "$TMP/m$mismatches." "$TMP/demux.fq"
+done
+check "demultiplexed sample, exact barcode" "$(sort "$TMP/m0.A.fastq" | cksum)" "$(sample_reads 0)"
+check "demultiplexed sample, other barcode" "$(sort "$TMP/m0.B.fastq" | cksum)" "$(sample_reads 1)"
+check "demultiplexed undetermined reads" "$(sort "$TMP/m0.undetermined.fastq" | cksum)" "$(sample_reads 23)"
+check "demultiplexed sample, one mismatch per index" "$(sort "$TMP/m1.A.fastq" | cksum)" "$(sample_reads 02)"
+check "demultiplexed sample, one mismatch per index, other barcode" "$(sort "$TMP/m1.B.fastq" | cksum)" "$(sample_reads 1)"
+
+# A run killed after its fingerprint pass, while it is stuck writing to a
+# pipe nobody reads, leaves its last checkpoint behind; resuming from it
+# gives the same reads as a run that was never interrupted.
+mkfifo "$TMP/pipe"
+"$SEQUNIQ" --checkpoint "$TMP/in.ckpt" --checkpoint-interval 0 "$TMP/in.fq" > "$TMP/pipe" &
+pid=$!
+exec 3< "$TMP/pipe"
+i=0
+while [ ! -f "$TMP/in.ckpt" ] && [ $i -lt 30 ]; do sleep 1; i=$((i + 1)); done
+sleep 1
+kill -9 $pid
+wait $pid 2> /dev/null
+exec 3<&-
+if [ -f "$TMP/in.ckpt" ]; then
+    resumed=$("$SEQUNIQ" --checkpoint "$TMP/in.ckpt" --resume "$TMP/in.fq" | sort | cksum)
+    check "resumed run = uninterrupted run" "$resumed" "$hash"
+else
+    check "resumed run = uninterrupted run" "no checkpoint" checkpoint
+fi
+
+exit $failed
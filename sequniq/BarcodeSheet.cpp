@@ -0,0 +1,143 @@
+#include "BarcodeSheet.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Marks a sequence close to barcodes of several samples. */
+#define AMBIGUOUS -1
+
+static bool valid_barcode (const std::string &barcode) {
+    if (barcode.empty() || barcode[0] == '+' || barcode[barcode.size() - 1] == '+')
+        return false;
+    for (size_t i = 0; i < barcode.size(); i++) {
+        if (!strchr("ACGTN+", barcode[i]))
+            return false;
+    }
+    return true;
+}
+
+bool BarcodeSheet::load(const char *path, int mismatches)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: could not open %s\n", path);
+        return false;
+    }
+
+    std::unordered_map<std::string, int> exact;
+    std::unordered_map<std::string, int> sampleNumbers;
+    char line[4096];
+    int lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineNumber++;
+        std::vector<std::string> fields;
+        for (char *field = strtok(line, " \t\r\n"); field; field = strtok(NULL, " \t\r\n"))
+            fields.push_back(field);
+        if (fields.empty() || fields[0][0] == '#')
+            continue;
+        if (fields.size() != 2 || !valid_barcode(fields[1])) {
+            fprintf(stderr, "ERROR: %s:%d: expected a sample name and a barcode of ACGTN, i7+i5 for dual indexes\n", path, lineNumber);
+            ok = false;
+            break;
+        }
+
+        auto known = sampleNumbers.find(fields[0]);
+        int sample;
+        if (known != sampleNumbers.end()) {
+            sample = known->second;
+        } else {
+            sample = (int)names.size();
+            names.push_back(fields[0]);
+            sampleNumbers[fields[0]] = sample;
+        }
+
+        auto other = exact.find(fields[1]);
+        if (other != exact.end() && other->second != sample) {
+            fprintf(stderr, "ERROR: %s:%d: barcode %s is already used by sample %s\n",
+                    path, lineNumber, fields[1].c_str(), names[other->second].c_str());
+            ok = false;
+            break;
+        }
+        exact[fields[1]] = sample;
+    }
+    fclose(f);
+    if (!ok)
+        return false;
+
+    barcodes.clear();
+    if (mismatches > 0) {
+        for (auto it = exact.begin(); it != exact.end(); ++it) {
+            std::string barcode = it->first;
+            addVariants(barcode, 0, mismatches, mismatches, it->second, exact);
+        }
+    }
+    for (auto it = exact.begin(); it != exact.end(); ++it)
+        barcodes[it->first] = it->second;
+    for (auto it = barcodes.begin(); it != barcodes.end();) {
+        if (it->second == AMBIGUOUS)
+            it = barcodes.erase(it);
+        else
+            ++it;
+    }
+    return true;
+}
+
+/* Enters every sequence that differs from barcode in up to `mismatches`
+ positions at or after `from` in the current index, and in up to `limit`
+ positions in each index after it. The separator of dual indexes stays put. */
+void BarcodeSheet::addVariants(std::string &barcode, size_t from, int mismatches, int limit,
+                               int sample, const std::unordered_map<std::string, int> &exact)
+{
+    static const char BASES[] = "ACGTN";
+    size_t end = barcode.find('+', from);
+    if (end == std::string::npos)
+        end = barcode.size();
+    else
+        addVariants(barcode, end + 1, limit, limit, sample, exact);
+    if (mismatches == 0)
+        return;
+    for (size_t i = from; i < end; i++) {
+        char original = barcode[i];
+        for (const char *b = BASES; *b; b++) {
+            if (*b == original)
+                continue;
+            barcode[i] = *b;
+            if (!exact.count(barcode)) {
+                auto variant = barcodes.find(barcode);
+                if (variant == barcodes.end())
+                    barcodes[barcode] = sample;
+                else if (variant->second != sample)
+                    variant->second = AMBIGUOUS;
+            }
+            addVariants(barcode, i + 1, mismatches - 1, limit, sample, exact);
+        }
+        barcode[i] = original;
+    }
+}
+
+int BarcodeSheet::lookup(const char *index, size_t length) const
+{
+    scratch.assign(index, length);
+    auto it = barcodes.find(scratch);
+    return it == barcodes.end() ? -1 : it->second;
+}
+
+StringSpan BarcodeSheet::headerIndex(const FastqRecord &rec)
+{
+    StringSpan index = { rec.comment.s, 0 };
+    const char *end = rec.comment.s + rec.comment.l;
+    const char *colon = NULL;
+    for (const char *p = rec.comment.s; p < end; p++) {
+        if (*p == ':')
+            colon = p;
+    }
+    if (!colon)
+        return index;
+    const char *p = colon + 1;
+    while (p < end && *p != ' ' && *p != '\t')
+        p++;
+    index.s = colon + 1;
+    index.l = p - index.s;
+    return index;
+}
@@ -0,0 +1,46 @@
+#ifndef _BARCODESHEET_H_
+#define _BARCODESHEET_H_
+
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "FastqReader.h"
+
+/* Sample barcodes for demultiplexing. Each line of a sheet holds a sample
+ name and its index sequence, "i7+i5" for dual indexes; a sample may have
+ several lines. Blank lines and lines starting with '#' are skipped.
+
+ Lookups are a single hash probe: for mismatch tolerance, every sequence
+ within the allowed Hamming distance of a barcode is entered up front.
+ Sequences that would match barcodes of two different samples are left out,
+ so they stay unassigned, but an exact match always wins. */
+class BarcodeSheet
+{
+public:
+    /* Loads path, accepting up to `mismatches` substitutions per index.
+     Prints an error and returns false on malformed sheets. */
+    bool load(const char *path, int mismatches);
+
+    size_t samples() const { return names.size(); }
+    const std::string &name(size_t sample) const { return names[sample]; }
+
+    /* Sample number for an index sequence, or -1 if there is none. Not
+     thread safe. */
+    int lookup(const char *index, size_t length) const;
+
+    /* The index sequence Illumina writes at the end of the header comment,
+     "1:N:0:ACGTACGT+TTGGCCAA"; l == 0 if the comment has none. */
+    static StringSpan headerIndex(const FastqRecord &rec);
+
+private:
+    std::vector<std::string> names;
+    std::unordered_map<std::string, int> barcodes;
+    mutable std::string scratch;
+
+    void addVariants(std::string &barcode, size_t from, int mismatches, int limit,
+                     int sample, const std::unordered_map<std::string, int> &exact);
+};
+
+#endif // _BARCODESHEET_H_
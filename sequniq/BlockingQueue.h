@@ -0,0 +1,46 @@
+#ifndef _BLOCKINGQUEUE_H_
+#define _BLOCKINGQUEUE_H_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/* Unbounded FIFO shared between threads; pop() waits for an element. The
+ I/O threads bound their memory by circulating a fixed set of buffers
+ between a "free" and a "filled" queue. */
+template <typename T>
+class BlockingQueue
+{
+public:
+    void push(const T &value)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(value);
+        }
+        ready.notify_one();
+    }
+
+    T pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (items.empty())
+            ready.wait(lock);
+        T value = items.front();
+        items.pop_front();
+        return value;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.clear();
+    }
+
+private:
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable ready;
+};
+
+#endif // _BLOCKINGQUEUE_H_
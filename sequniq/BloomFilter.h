@@ -0,0 +1,91 @@
+#ifndef _BLOOMFILTER_H_
+#define _BLOOMFILTER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Memory.h"
+
+/* A blocked Bloom filter over 128-bit read fingerprints. Every key is mapped
+ to a single 64-byte block (one cache line) in which BLOOM_K bits are set, so
+ an insert or lookup costs one memory access regardless of k. The first half
+ of the fingerprint selects the block, the second half the bits inside it. */
+
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_BYTES * 8)
+#define BLOOM_K 6
+
+class BlockedBloomFilter
+{
+public:
+    /* The filter uses at most `bytes` of memory, rounded down to a power of
+     two number of blocks (but at least one block). The blocks come zeroed
+     from arena_alloc, page by page as they are first touched, so a filter
+     sized for large inputs costs little on a small one. */
+    BlockedBloomFilter(size_t bytes)
+        : mapped(0)
+    {
+        nblocks = 1;
+        while (nblocks * 2 * BLOOM_BLOCK_BYTES <= bytes)
+            nblocks *= 2;
+        blocks = (Block *)arena_alloc(nblocks * BLOOM_BLOCK_BYTES, 0, &mapped);
+    }
+
+    ~BlockedBloomFilter()
+    {
+        arena_free(blocks, mapped);
+    }
+
+    bool valid() const { return blocks != NULL; }
+    /* Unsets all bits. */
+    void clear() { memset(blocks, 0, size()); }
+    size_t size() const { return nblocks * BLOOM_BLOCK_BYTES; }
+    /* The raw bits, size() bytes, e.g. for saving the filter. */
+    void *data() { return blocks; }
+    const void *data() const { return blocks; }
+
+    /* Sets the bits of key and returns true if all of them were set before,
+     i.e. if key has (probably) been inserted already. */
+    bool testAndSet(const uint64_t *key)
+    {
+        uint64_t *block = blocks[key[0] & (nblocks - 1)].words;
+        uint64_t bits = key[1];
+        bool present = true;
+        for (int i = 0; i < BLOOM_K; i++, bits >>= 9) {
+            uint64_t mask = 1ULL << (bits & 63);
+            uint64_t *word = block + ((bits >> 6) & 7);
+            if (!(*word & mask)) {
+                present = false;
+                *word |= mask;
+            }
+        }
+        return present;
+    }
+
+    /* Returns false if key has definitely never been inserted. */
+    bool test(const uint64_t *key) const
+    {
+        const uint64_t *block = blocks[key[0] & (nblocks - 1)].words;
+        uint64_t bits = key[1];
+        for (int i = 0; i < BLOOM_K; i++, bits >>= 9) {
+            if (!(block[(bits >> 6) & 7] & (1ULL << (bits & 63))))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    struct Block
+    {
+        uint64_t words[BLOOM_BLOCK_BYTES / sizeof(uint64_t)];
+    };
+
+    Block *blocks;
+    size_t nblocks;
+    size_t mapped;
+
+    BlockedBloomFilter(const BlockedBloomFilter &);
+    BlockedBloomFilter &operator=(const BlockedBloomFilter &);
+};
+
+#endif // _BLOOMFILTER_H_
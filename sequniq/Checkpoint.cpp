@@ -0,0 +1,101 @@
+#include "Checkpoint.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+
+static const char CHECKPOINT_MAGIC[8] = { 'S', 'Q', 'C', 'K', 'P', 'T', '0', '2' };
+
+void checkpoint_options(CheckpointHeader *header, const DedupOptions &options)
+{
+    header->engine = options.engine;
+    header->seed = options.seed;
+    header->shard = options.shard;
+    header->shards = options.shards;
+    header->countSets = options.countSets;
+    header->reserved = 0;
+    header->bloomBytes = options.bloomBytes;
+}
+
+bool checkpoint_matches(const CheckpointHeader &header, const DedupOptions &options)
+{
+    return header.engine == (uint32_t)options.engine && header.shard == options.shard &&
+        header.shards == options.shards && header.countSets == (uint32_t)options.countSets &&
+        header.bloomBytes == options.bloomBytes;
+}
+
+static bool write_checkpoint (const char *path, const CheckpointHeader &header, const Deduplicator &dedup) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out)
+        return false;
+    static char buffer[1 << 20];
+    setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+    bool ok = fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC), out) == sizeof(CHECKPOINT_MAGIC) &&
+        fwrite(&header, sizeof(header), 1, out) == 1 &&
+        dedup.save(out);
+    // the data must be on disk before the rename makes it the checkpoint
+    ok = fflush(out) == 0 && ok;
+    ok = fsync(fileno(out)) == 0 && ok;
+    ok = fclose(out) == 0 && ok;
+    if (ok && rename(tmp.c_str(), path) == 0)
+        return true;
+    unlink(tmp.c_str());
+    return false;
+}
+
+pid_t start_checkpoint(const char *path, const CheckpointHeader &header, const Deduplicator &dedup)
+{
+    fflush(stdout);
+    fflush(stderr);
+    pid_t child = fork();
+    if (child != 0)
+        return child;
+    // in the child: _exit, so that no destructor joins threads only the
+    // parent has; failures are reported by the parent
+    _exit(write_checkpoint(path, header, dedup) ? 0 : 1);
+}
+
+int finish_checkpoint(pid_t child, bool wait)
+{
+    int status;
+    pid_t r = waitpid(child, &status, wait ? 0 : WNOHANG);
+    if (r == 0)
+        return 0;
+    return r == child && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 1 : -1;
+}
+
+static FILE *open_checkpoint (const char *path, CheckpointHeader *header) {
+    FILE *in = fopen(path, "rb");
+    if (!in)
+        return NULL;
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+        fread(header, sizeof(*header), 1, in) != 1) {
+        fclose(in);
+        return NULL;
+    }
+    return in;
+}
+
+bool read_checkpoint_header(const char *path, CheckpointHeader *header)
+{
+    FILE *in = open_checkpoint(path, header);
+    if (!in)
+        return false;
+    fclose(in);
+    return true;
+}
+
+bool read_checkpoint(const char *path, CheckpointHeader *header, Deduplicator &dedup)
+{
+    FILE *in = open_checkpoint(path, header);
+    if (!in)
+        return false;
+    bool ok = dedup.restore(in) && fgetc(in) == EOF;
+    fclose(in);
+    return ok;
+}
@@ -0,0 +1,50 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "Deduplicator.h"
+
+/* A checkpoint lets a preempted run continue its fingerprint pass: the
+ Deduplicator state after some reads, and where the next read starts in
+ each input. The header also records what a resumed run has to agree on,
+ the deduplication options and the size of the input files. */
+struct CheckpointHeader
+{
+    uint32_t engine;
+    uint32_t seed;
+    uint32_t shard;
+    uint32_t shards;
+    uint32_t countSets;
+    uint32_t reserved;
+    uint64_t bloomBytes;
+    uint64_t inputBytes[2]; // sizes of the input files, 0 for no second file
+    uint64_t offset[2];     // (decompressed) position of the next read
+};
+
+/* Fills in the options part of a header. */
+void checkpoint_options(CheckpointHeader *header, const DedupOptions &options);
+/* True if header was written with options that a run with `options` can
+ continue from; the seed is taken over from the checkpoint. */
+bool checkpoint_matches(const CheckpointHeader &header, const DedupOptions &options);
+
+/* Writes a checkpoint to path from a forked child process. The child works
+ on a copy-on-write snapshot of the process, so the caller can go on adding
+ reads right away; memory only grows by the pages it changes meanwhile.
+ The file is written under a temporary name and renamed when complete, so
+ a crash never leaves a partial checkpoint behind. Tables in explicit huge
+ pages can get the child killed, so allocate them with ARENA_FORKABLE.
+ Returns the pid of the child, or -1 if it could not be started. */
+pid_t start_checkpoint(const char *path, const CheckpointHeader &header, const Deduplicator &dedup);
+/* Reaps the child of start_checkpoint. Without `wait`, returns 0 if it is
+ still running; otherwise 1 if the checkpoint was written and -1 if not. */
+int finish_checkpoint(pid_t child, bool wait);
+
+/* Reads only the header. Returns false if path is not a checkpoint. */
+bool read_checkpoint_header(const char *path, CheckpointHeader *header);
+/* Reads a checkpoint into header and dedup. Returns false if it cannot be
+ read or does not fit dedup. */
+bool read_checkpoint(const char *path, CheckpointHeader *header, Deduplicator &dedup);
+
+#endif // _CHECKPOINT_H_
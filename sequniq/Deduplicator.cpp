@@ -0,0 +1,327 @@
+#include "Deduplicator.h"
+
+#include "MurmurHash3.h"
+
+#if __x86_64__
+/* 64-bit */
+#define murmur(k, l, s, o) MurmurHash3_x64_128(k, l, s, o)
+#else
+#define murmur(k, l, s, o) MurmurHash3_x86_128(k, l, s, o)
+#endif
+
+/* Set number of reads that never enter the table; their set size is 1. */
+#define NO_SET UINT32_MAX
+
+/* Sort engine candidates kept for reuse by reset(); larger arrays are
+ freed after finish(). */
+#define KEEP_RECORDS (1 << 20)
+
+static bool write_all (FILE *out, const void *data, size_t n) {
+    return n == 0 || fwrite(data, 1, n, out) == n;
+}
+
+static bool read_all (FILE *in, void *data, size_t n) {
+    return n == 0 || fread(data, 1, n, in) == n;
+}
+
+template <typename T>
+static bool write_vector (FILE *out, const std::vector<T> &v) {
+    uint64_t n = v.size();
+    return write_all(out, &n, sizeof(n)) && write_all(out, v.data(), n * sizeof(T));
+}
+
+template <typename T>
+static bool read_vector (FILE *in, std::vector<T> &v) {
+    uint64_t n;
+    if (!read_all(in, &n, sizeof(n)))
+        return false;
+    v.resize(n);
+    return read_all(in, v.data(), n * sizeof(T));
+}
+
+static int calculate_score (const StringSpan &scoreString) {
+    int result = 0;
+    for (size_t i = 0; i < scoreString.l; i++)
+        result += scoreString.s[i] - 33;
+    return result;
+}
+
+DedupOptions::DedupOptions()
+    : engine(ENGINE_HASH), threads(1), arenaFlags(ARENA_DEFAULT), seed(0), bloomBytes(0),
+      shard(0), shards(0), countSets(false)
+{
+}
+
+Deduplicator::Deduplicator(const DedupOptions &options)
+    : options(options), hashtable(NULL), seen(NULL), repeated(NULL)
+{
+    if (options.engine == ENGINE_HASH)
+        hashtable = new FingerprintTable(options.arenaFlags);
+    createFilters();
+}
+
+Deduplicator::~Deduplicator()
+{
+    delete hashtable;
+    delete seen;
+    delete repeated;
+}
+
+/* Creates the filters that add() and finish() freed, and clears the others. */
+void Deduplicator::createFilters()
+{
+    if (options.bloomBytes > 0) {
+        // half the budget per filter
+        if (seen && seen->valid()) {
+            seen->clear();
+        } else {
+            delete seen;
+            seen = new BlockedBloomFilter(options.bloomBytes / 2);
+        }
+        if (repeated && repeated->valid()) {
+            repeated->clear();
+        } else {
+            delete repeated;
+            repeated = new BlockedBloomFilter(options.bloomBytes / 2);
+        }
+    }
+}
+
+void Deduplicator::reset()
+{
+    if (hashtable)
+        hashtable->clear();
+    createFilters();
+    records.clear();
+    keep.clear();
+    sets.clear();
+    setCounts.clear();
+}
+
+bool Deduplicator::valid() const
+{
+    return (!hashtable || hashtable->valid()) && (!seen || (seen->valid() && repeated->valid()));
+}
+
+void Deduplicator::fingerprint(const FastqRecord &rec1, const FastqRecord *rec2, uint32_t seed, uint64_t *key, std::string &pairBuf)
+{
+    if (rec2) {
+        pairBuf.assign(rec1.seq.s, rec1.seq.l);
+        pairBuf.append(rec2->seq.s, rec2->seq.l);
+        murmur(pairBuf.data(), (int)pairBuf.size(), seed, key);
+    } else {
+        murmur(rec1.seq.s, (int)rec1.seq.l, seed, key);
+    }
+}
+
+/* Pre-pass: a fingerprint goes into `repeated` the second time it is seen.
+ Bloom filters have no false negatives, so anything missing from `repeated`
+ afterwards occurs exactly once and cannot be a duplicate. */
+void Deduplicator::prescan(const FastqRecord &rec1, const FastqRecord *rec2)
+{
+    if (!seen)
+        return;
+    uint64_t key[2];
+    fingerprint(rec1, rec2, options.seed, key, pairBuf);
+    if (mine(key) && seen->testAndSet(key))
+        repeated->testAndSet(key);
+}
+
+bool Deduplicator::add(const FastqRecord &rec1, const FastqRecord *rec2)
+{
+    if (seen) {
+        // the pre-pass is over
+        delete seen;
+        seen = NULL;
+    }
+
+    uint64_t ordinal = keep.size();
+    uint64_t key[2];
+    fingerprint(rec1, rec2, options.seed, key, pairBuf);
+
+    // other shards decide on reads outside our partition
+    if (!mine(key)) {
+        keep.push_back(false);
+        if (options.countSets)
+            sets.push_back(NO_SET);
+        return true;
+    }
+
+    int qual = calculate_score(rec1.qual);
+    if (rec2)
+        qual += calculate_score(rec2->qual);
+
+    bool singleton = repeated && !repeated->test(key);
+    if (singleton || options.engine == ENGINE_SORT) {
+        if (!singleton) {
+            FingerprintRecord r;
+            r.hash[0] = key[0];
+            r.hash[1] = key[1];
+            r.ordinal = ordinal;
+            r.qual = qual;
+            records.push_back(r);
+        }
+        keep.push_back(singleton);
+        if (options.countSets)
+            sets.push_back(NO_SET);
+        return true;
+    }
+
+    // hash engine: the table always holds the ordinal of the read to keep
+    bool inserted;
+    FingerprintTable::Slot *slot = hashtable->insert(key, &inserted);
+    if (!slot)
+        return false;
+    keep.push_back(false);
+    if (inserted) {
+        slot->value.ordinal = ordinal;
+        slot->value.qual = qual;
+        slot->value.set = (uint32_t)setCounts.size();
+        keep[ordinal] = true;
+        if (options.countSets)
+            setCounts.push_back(0);
+    } else if (slot->value.qual < qual) {
+        keep[slot->value.ordinal] = false;
+        keep[ordinal] = true;
+        slot->value.ordinal = ordinal;
+        slot->value.qual = qual;
+    }
+    if (options.countSets) {
+        setCounts[slot->value.set]++;
+        sets.push_back(slot->value.set);
+    }
+    return true;
+}
+
+bool Deduplicator::add(const FastqRecord *recs1, const FastqRecord *recs2, size_t n)
+{
+    keep.reserve(keep.size() + n);
+    for (size_t i = 0; i < n; i++) {
+        if (!add(recs1[i], recs2 ? &recs2[i] : NULL))
+            return false;
+    }
+    return true;
+}
+
+void Deduplicator::finish()
+{
+    delete repeated;
+    repeated = NULL;
+
+    if (options.countSets) {
+        // set numbers become set sizes
+        for (size_t i = 0; i < sets.size(); i++)
+            sets[i] = sets[i] == NO_SET ? 1 : setCounts[sets[i]];
+        std::vector<uint32_t>().swap(setCounts);
+    }
+
+    if (options.engine != ENGINE_SORT)
+        return;
+
+    radix_sort_records(records.data(), records.size(), options.threads);
+
+    // Equal fingerprints are now adjacent and in input order, so the first
+    // record with the highest score of each run wins, as in the table.
+    size_t first = 0, best = 0;
+    for (size_t i = 1; i <= records.size(); i++) {
+        if (i == records.size() ||
+            records[i].hash[0] != records[first].hash[0] ||
+            records[i].hash[1] != records[first].hash[1]) {
+            keep[records[best].ordinal] = true;
+            if (options.countSets) {
+                for (size_t j = first; j < i; j++)
+                    sets[records[j].ordinal] = (uint32_t)(i - first);
+            }
+            first = best = i;
+        } else if (records[i].qual > records[best].qual) {
+            best = i;
+        }
+    }
+    if (records.capacity() > KEEP_RECORDS)
+        std::vector<FingerprintRecord>().swap(records);
+    else
+        records.clear();
+}
+
+/* Layout: the keep flags packed 64 to a word, the set numbers and counts,
+ the sort engine candidates, the occupied table slots and the `repeated`
+ Bloom filter. Empty slots are skipped, which also makes the snapshot
+ independent of the table capacity. */
+bool Deduplicator::save(FILE *out) const
+{
+    uint64_t reads = keep.size();
+    bool ok = write_all(out, &reads, sizeof(reads));
+    uint64_t words[4096];
+    for (uint64_t i = 0; ok && i < reads;) {
+        size_t n = 0;
+        for (; n < 4096 && i < reads; n++) {
+            uint64_t word = 0;
+            for (int bit = 0; bit < 64 && i < reads; bit++, i++)
+                word |= (uint64_t)keep[i] << bit;
+            words[n] = word;
+        }
+        ok = write_all(out, words, n * sizeof(uint64_t));
+    }
+
+    ok = ok && write_vector(out, sets) && write_vector(out, setCounts) && write_vector(out, records);
+
+    uint64_t slots = hashtable ? hashtable->size() : 0;
+    ok = ok && write_all(out, &slots, sizeof(slots));
+    if (ok && hashtable) {
+        hashtable->for_each([&](const FingerprintTable::Slot &slot) {
+            ok = ok && write_all(out, &slot, sizeof(slot));
+        });
+    }
+
+    uint64_t bloomBytes = repeated ? repeated->size() : 0;
+    ok = ok && write_all(out, &bloomBytes, sizeof(bloomBytes));
+    return ok && (!repeated || write_all(out, repeated->data(), bloomBytes));
+}
+
+bool Deduplicator::restore(FILE *in)
+{
+    reset();
+    // the pre-pass is part of the snapshot
+    delete seen;
+    seen = NULL;
+
+    uint64_t reads;
+    if (!read_all(in, &reads, sizeof(reads)))
+        return false;
+    keep.resize(reads);
+    uint64_t words[4096];
+    for (uint64_t i = 0; i < reads;) {
+        uint64_t left = (reads - i + 63) / 64;
+        size_t n = left < 4096 ? (size_t)left : 4096;
+        if (!read_all(in, words, n * sizeof(uint64_t)))
+            return false;
+        for (size_t w = 0; w < n; w++) {
+            for (int bit = 0; bit < 64 && i < reads; bit++, i++)
+                keep[i] = (words[w] >> bit) & 1;
+        }
+    }
+
+    if (!read_vector(in, sets) || !read_vector(in, setCounts) || !read_vector(in, records))
+        return false;
+
+    uint64_t slots;
+    if (!read_all(in, &slots, sizeof(slots)) || (slots > 0 && !hashtable))
+        return false;
+    for (uint64_t i = 0; i < slots; i++) {
+        FingerprintTable::Slot slot;
+        bool inserted;
+        if (!read_all(in, &slot, sizeof(slot)))
+            return false;
+        FingerprintTable::Slot *s = hashtable->insert(slot.key, &inserted);
+        if (!s)
+            return false;
+        s->value = slot.value;
+    }
+
+    uint64_t bloomBytes;
+    if (!read_all(in, &bloomBytes, sizeof(bloomBytes)))
+        return false;
+    if (bloomBytes != (repeated ? repeated->size() : 0))
+        return false;
+    return !repeated || read_all(in, repeated->data(), bloomBytes);
+}
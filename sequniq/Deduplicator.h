@@ -0,0 +1,111 @@
+#ifndef _DEDUPLICATOR_H_
+#define _DEDUPLICATOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "FastqReader.h"
+#include "FingerprintTable.h"
+#include "RadixSort.h"
+#include "BloomFilter.h"
+
+enum DedupEngine
+{
+    ENGINE_HASH, // hash table of the best read per fingerprint
+    ENGINE_SORT  // radix sort of all fingerprints at the end
+};
+
+struct DedupOptions
+{
+    DedupEngine engine;
+    int threads;          // sort engine threads
+    int arenaFlags;       // backing memory of the hash table (Memory.h)
+    uint32_t seed;        // fingerprint seed
+    size_t bloomBytes;    // Bloom filter memory for prescan(), 0 = none
+    unsigned shard;       // with shards > 0, only decide on reads whose
+    unsigned shards;      // (fingerprint[0] >> 40) % shards == shard
+    bool countSets;       // keep the duplicate set size of every read
+
+    DedupOptions();
+};
+
+/* Decides which reads (or read pairs) of a stream to keep: of all reads with
+ the same sequence, the first one with the highest quality sum. Reads are
+ passed in input order to add(), which numbers them from 0 (their ordinal)
+ and looks at them only during the call, so records can point straight into
+ a reader's buffer. After finish(), kept() and keepFlags() tell which
+ ordinals to write out.
+
+ With options.bloomBytes set, every read must first be passed to prescan()
+ in a separate pass over the input; reads seen once then bypass the engine. */
+class Deduplicator
+{
+public:
+    Deduplicator(const DedupOptions &options);
+    ~Deduplicator();
+
+    /* False if the Bloom filter or the hash table could not be allocated. */
+    bool valid() const;
+
+    /* Enters a read (pair) into the Bloom pre-pass. Does nothing without
+     options.bloomBytes or once the first read has been added. */
+    void prescan(const FastqRecord &rec1, const FastqRecord *rec2 = NULL);
+    /* Adds one read, or a read pair if rec2 is set. Returns false if the
+     hash table ran out of memory; the deduplicator is unusable then. */
+    bool add(const FastqRecord &rec1, const FastqRecord *rec2 = NULL);
+    /* Adds n reads, or n pairs if recs2 is set; false as for one read. */
+    bool add(const FastqRecord *recs1, const FastqRecord *recs2, size_t n);
+    void finish();
+    /* Forgets all reads to start over with another input, keeping the
+     table and buffer memory. */
+    void reset();
+
+    /* Writes the state after the reads added so far, to continue with
+     restore() in a deduplicator with the same options, e.g. after a
+     restart. Returns false on I/O errors. */
+    bool save(FILE *out) const;
+    /* Replaces the state by one written by save(), skipping the Bloom
+     pre-pass. Returns false if it cannot be read. */
+    bool restore(FILE *in);
+
+    uint64_t reads() const { return keep.size(); }
+    bool kept(uint64_t ordinal) const { return keep[ordinal]; }
+    const std::vector<bool> &keepFlags() const { return keep; }
+    /* With options.countSets, the number of reads with the same fingerprint
+     as each read; empty otherwise. */
+    const std::vector<uint32_t> &setSizes() const { return sets; }
+    /* The hash table, NULL for the sort engine. */
+    const FingerprintTable *table() const { return hashtable; }
+
+    /* Computes the 128-bit fingerprint of a read (pair) with seed; pairBuf
+     is scratch space for joining the mates. */
+    static void fingerprint(const FastqRecord &rec1, const FastqRecord *rec2, uint32_t seed, uint64_t *key, std::string &pairBuf);
+
+private:
+    DedupOptions options;
+    FingerprintTable *hashtable;
+    BlockedBloomFilter *seen, *repeated;
+    std::vector<FingerprintRecord> records; // sort engine candidates
+    std::vector<bool> keep;
+    /* Per read: the duplicate set size after finish(); before, the hash
+     engine stores set numbers here and counts their reads in setCounts. */
+    std::vector<uint32_t> sets;
+    std::vector<uint32_t> setCounts;
+    std::string pairBuf;
+
+    void createFilters();
+    // the top bits of key[0], which neither the table, the Bloom filter
+    // nor the estimator look at
+    bool mine(const uint64_t *key) const
+    {
+        return options.shards == 0 || (key[0] >> 40) % options.shards == options.shard;
+    }
+
+    Deduplicator(const Deduplicator &);
+    Deduplicator &operator=(const Deduplicator &);
+};
+
+#endif // _DEDUPLICATOR_H_
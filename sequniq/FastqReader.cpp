@@ -0,0 +1,537 @@
+#include "FastqReader.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define BLOCK_SIZE (4 << 20)
+#define SEEK_BLOCK_SIZE (16 << 10)
+#define READ_AHEAD_BLOCKS 3
+#define BLOCK_HEADROOM (64 << 10) // room for the unread tail of the previous block
+
+static inline const char *find_newline (const char *p, const char *e) {
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; e - p >= 32; p += 32) {
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl));
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; e - p >= 16; p += 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+#endif
+    return (const char *)memchr(p, '\n', e - p);
+}
+
+/* Sets span to [p, lineEnd), dropping a trailing '\r'. */
+static inline void set_span (StringSpan &span, const char *p, const char *lineEnd) {
+    if (lineEnd > p && lineEnd[-1] == '\r')
+        lineEnd--;
+    span.s = p;
+    span.l = lineEnd - p;
+}
+
+/* Copies standard input to an unlinked temporary file, because the input is
+ read more than once. Returns its descriptor, positioned at the start. */
+static int spool_stdin () {
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/sequniq.XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    int fd = mkstemp(name.data());
+    if (fd < 0)
+        return -1;
+    unlink(name.data());
+
+    std::vector<char> chunk(1 << 20);
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, chunk.data(), chunk.size())) > 0) {
+        if (write(fd, chunk.data(), n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    if (n < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+#ifdef HAVE_ZSTD
+/* Decompression state; kept out of the header so that the layout of the
+ class does not depend on how the library was built. */
+struct FastqReader::ZstdInput
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in; // compressed input read from fd
+    size_t inCapacity;
+    uint64_t pos;     // position in the decompressed input
+    bool inFrame;     // a frame has started but not ended yet
+};
+#endif
+
+FastqReader::FastqReader()
+    : fd(-1), gz(NULL), zstdInput(false), zstd(NULL), eof(false), failed(false), buf(NULL), capacity(0), start(0), begin(0), end(0), base(0),
+      own(NULL), ownCapacity(0), readSize(BLOCK_SIZE), stopping(false), inputRead(0), outputRead(0)
+{
+    current.data = NULL;
+    current.len = 0;
+}
+
+FastqReader::~FastqReader()
+{
+    close();
+    free(own);
+    for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+#ifdef HAVE_ZSTD
+    if (zstd) {
+        ZSTD_freeDCtx(zstd->dctx);
+        free((void *)zstd->in.src);
+        delete zstd;
+    }
+#endif
+}
+
+bool FastqReader::open(const char *path)
+{
+    close();
+    fd = strcmp(path, "-") == 0 ? spool_stdin() : ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    unsigned char magic[4];
+    ssize_t magicLen = pread(fd, magic, 4, 0);
+    bool gzipped = magicLen >= 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+    zstdInput = magicLen == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd;
+    if (zstdInput) {
+#ifdef HAVE_ZSTD
+        if (!zstd) {
+            zstd = new ZstdInput;
+            zstd->dctx = ZSTD_createDCtx();
+            zstd->inCapacity = ZSTD_DStreamInSize();
+            zstd->in.src = malloc(zstd->inCapacity);
+        }
+        ZSTD_DCtx_reset(zstd->dctx, ZSTD_reset_session_only);
+        zstd->in.size = zstd->in.pos = 0;
+        zstd->pos = 0;
+        zstd->inFrame = true;
+#else
+        fprintf(stderr, "ERROR: %s is Zstandard compressed, but sequniq was built without zstd support\n", path);
+        ::close(fd);
+        fd = -1;
+        return false;
+#endif
+    } else if (gzipped) {
+        gz = gzdopen(fd, "r");
+        if (!gz) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        gzbuffer(gz, 1 << 17);
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    else {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+
+    if (!own) {
+        ownCapacity = BLOCK_SIZE;
+        own = (char *)malloc(ownCapacity);
+    }
+    inputRead = outputRead = 0;
+    useOwnBuffer(0);
+    startReadAhead();
+    return true;
+}
+
+void FastqReader::close()
+{
+    stopReadAhead();
+    if (gz)
+        gzclose(gz); // also closes fd
+    else if (fd >= 0)
+        ::close(fd);
+    gz = NULL;
+    fd = -1;
+}
+
+/* Empties the buffer and makes `own` the current buffer, positioned at offset. */
+void FastqReader::useOwnBuffer(uint64_t offset)
+{
+    buf = own;
+    capacity = ownCapacity;
+    current.data = NULL;
+    start = begin = end = 0;
+    base = (int64_t)offset;
+    eof = false;
+    failed = false;
+}
+
+long FastqReader::readInput(char *dst, size_t n)
+{
+    long got;
+    off_t pos;
+    if (gz) {
+        got = gzread(gz, dst, (unsigned)n);
+        pos = gzoffset(gz);
+        int status;
+        // a truncated stream ends with Z_BUF_ERROR instead of Z_OK
+        if (got == 0 && (gzerror(gz, &status), status != Z_OK))
+            got = -1;
+    }
+#ifdef HAVE_ZSTD
+    else if (zstdInput) {
+        got = zstdRead(dst, n);
+        // not counting the input zstd has not decompressed yet
+        pos = lseek(fd, 0, SEEK_CUR) - (off_t)(zstd->in.size - zstd->in.pos);
+    }
+#endif
+    else {
+        got = read(fd, dst, n);
+        pos = 0;
+    }
+    if (got > 0) {
+        inputRead = pos > 0 ? (uint64_t)pos : 0;
+        outputRead += got;
+    }
+    return got;
+}
+
+uint64_t FastqReader::estimatedSize() const
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return 0;
+    if (!compressed())
+        return (uint64_t)st.st_size;
+    uint64_t in = inputRead, out = outputRead;
+    return in ? (uint64_t)((double)st.st_size * out / in) : 0;
+}
+
+#ifdef HAVE_ZSTD
+/* Decompresses up to n bytes; fewer only at the end of the input. Returns
+ -1 on errors, including input that ends in the middle of a frame. */
+long FastqReader::zstdRead(char *dst, size_t n)
+{
+    ZSTD_outBuffer out = { dst, n, 0 };
+    while (out.pos < out.size) {
+        if (zstd->in.pos == zstd->in.size) {
+            ssize_t got = read(fd, (void *)zstd->in.src, zstd->inCapacity);
+            if (got < 0)
+                return -1;
+            if (got == 0) {
+                if (zstd->inFrame) {
+                    fprintf(stderr, "ERROR: zstd: truncated input\n");
+                    return -1;
+                }
+                break;
+            }
+            zstd->in.size = got;
+            zstd->in.pos = 0;
+        }
+        size_t ret = ZSTD_decompressStream(zstd->dctx, &out, &zstd->in);
+        if (ZSTD_isError(ret)) {
+            fprintf(stderr, "ERROR: zstd: %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        // 0 once a frame is complete and flushed
+        zstd->inFrame = ret != 0;
+    }
+    zstd->pos += out.pos;
+    return (long)out.pos;
+}
+
+/* zstd streams cannot be entered in the middle, so like gzseek this
+ restarts from the beginning when going backwards and decompresses up to
+ offset. */
+bool FastqReader::zstdSeek(uint64_t offset)
+{
+    if (offset < zstd->pos) {
+        if (lseek(fd, 0, SEEK_SET) < 0)
+            return false;
+        ZSTD_DCtx_reset(zstd->dctx, ZSTD_reset_session_only);
+        zstd->in.size = zstd->in.pos = 0;
+        zstd->pos = 0;
+        zstd->inFrame = true;
+    }
+    while (zstd->pos < offset) {
+        uint64_t skip = offset - zstd->pos;
+        long n = zstdRead(own, skip < ownCapacity ? (size_t)skip : ownCapacity);
+        if (n <= 0)
+            return false;
+    }
+    return true;
+}
+#endif
+
+void FastqReader::readAheadLoop()
+{
+    for (;;) {
+        Block b = freeBlocks.pop();
+        if (stopping || !b.data)
+            break;
+        b.len = readInput(b.data + BLOCK_HEADROOM, BLOCK_SIZE);
+        filledBlocks.push(b);
+        if (b.len <= 0)
+            break;
+    }
+}
+
+void FastqReader::startReadAhead()
+{
+    if (blocks.empty()) {
+        for (int i = 0; i < READ_AHEAD_BLOCKS; i++)
+            blocks.push_back((char *)malloc(BLOCK_HEADROOM + BLOCK_SIZE));
+    }
+    stopping = false;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        Block b = { blocks[i], 0 };
+        freeBlocks.push(b);
+    }
+    readAhead = std::thread(&FastqReader::readAheadLoop, this);
+}
+
+/* Stops the read-ahead thread. Blocks it has read but nobody consumed are
+ dropped, so the caller has to reposition the file and the buffer. */
+void FastqReader::stopReadAhead()
+{
+    if (!readAhead.joinable())
+        return;
+    stopping = true;
+    Block wake = { NULL, 0 };
+    freeBlocks.push(wake);
+    readAhead.join();
+    freeBlocks.clear();
+    filledBlocks.clear();
+}
+
+/* Makes the next block of input available after the unread bytes.
+ With read-ahead, the unread tail (normally part of one record) is copied
+ into the headroom in front of the next block, which then becomes the
+ buffer; the input itself is never copied. Synchronous reads append to
+ `own`, growing it if a single record does not fit, and start small after a
+ seek so that random access does not pay for a full block per record.
+ Returns false if nothing more could be read. */
+bool FastqReader::fill()
+{
+    if (eof)
+        return false;
+
+    size_t tail = end - begin;
+    int64_t tailOffset = base + (int64_t)begin;
+
+    if (readAhead.joinable()) {
+        Block b = filledBlocks.pop();
+        if (b.len <= 0) {
+            eof = true;
+            failed = b.len < 0;
+            return false;
+        }
+
+        if (tail <= BLOCK_HEADROOM) {
+            memcpy(b.data + BLOCK_HEADROOM - tail, buf + begin, tail);
+            if (current.data)
+                freeBlocks.push(current);
+            current = b;
+            buf = b.data;
+            capacity = BLOCK_HEADROOM + BLOCK_SIZE;
+            start = begin = BLOCK_HEADROOM - tail;
+            end = BLOCK_HEADROOM + b.len;
+        } else {
+            // a record longer than the headroom is stitched together in own;
+            // realloc may move own, so decide where the tail is first
+            bool inOwn = buf == own;
+            if (inOwn)
+                memmove(own, own + begin, tail);
+            if (tail + b.len > ownCapacity) {
+                while (tail + b.len > ownCapacity)
+                    ownCapacity *= 2;
+                own = (char *)realloc(own, ownCapacity);
+            }
+            if (!inOwn)
+                memcpy(own, buf + begin, tail);
+            memcpy(own + tail, b.data + BLOCK_HEADROOM, b.len);
+            if (current.data)
+                freeBlocks.push(current);
+            freeBlocks.push(b);
+            current.data = NULL;
+            buf = own;
+            capacity = ownCapacity;
+            start = begin = 0;
+            end = tail + b.len;
+        }
+        base = tailOffset - (int64_t)begin;
+        return true;
+    }
+
+    // synchronous reads always go to own
+    if (begin > 0) {
+        memmove(buf, buf + begin, tail);
+        begin = 0;
+        end = tail;
+        base = tailOffset;
+    }
+    start = 0;
+    if (end == capacity) {
+        ownCapacity *= 2;
+        own = (char *)realloc(own, ownCapacity);
+        buf = own;
+        capacity = ownCapacity;
+    }
+
+    size_t want = capacity - end < readSize ? capacity - end : readSize;
+    if (readSize < BLOCK_SIZE)
+        readSize *= 2;
+
+    long n = readInput(buf + end, want);
+    if (n <= 0) {
+        eof = true;
+        failed = n < 0;
+        return false;
+    }
+    end += n;
+    return true;
+}
+
+/* Parses the record starting at p. Returns the sequence length, -1 if the
+ buffer ends before the record does, or -2 if it is malformed. */
+int FastqReader::parseRecord(const char *p, FastqRecord &rec)
+{
+    const char *e = buf + end;
+    const char *nl[4];
+    const char *line = p;
+    int lines = 0;
+    for (; lines < 4; lines++) {
+        nl[lines] = find_newline(line, e);
+        if (!nl[lines])
+            break;
+        line = nl[lines] + 1;
+    }
+
+    if (lines < 4) {
+        if (!eof)
+            return -1;
+        // the last record may lack its final newline
+        if (lines < 3 || line == e)
+            return p == e ? -1 : -2;
+        nl[3] = e;
+    }
+
+    if (*p != '@' || *(nl[1] + 1) != '+')
+        return -2;
+
+    // header: name up to the first blank, the rest is the comment
+    const char *h = p + 1;
+    const char *blank = h;
+    while (blank < nl[0] && *blank != ' ' && *blank != '\t')
+        blank++;
+    set_span(rec.name, h, blank);
+    if (blank < nl[0])
+        set_span(rec.comment, blank + 1, nl[0]);
+    else
+        set_span(rec.comment, nl[0], nl[0]);
+
+    set_span(rec.seq, nl[0] + 1, nl[1]);
+    set_span(rec.qual, nl[2] + 1, nl[3]);
+    if (rec.seq.l != rec.qual.l)
+        return -2;
+
+    const char *recEnd = nl[3] < e ? nl[3] + 1 : e;
+    rec.raw.s = p;
+    rec.raw.l = recEnd - p;
+    rec.offset = (uint64_t)(base + (p - buf));
+    return (int)rec.seq.l;
+}
+
+/* Parses n consecutive records, refilling until all of them are in the
+ buffer at once. */
+int FastqReader::next(FastqRecord *recs, int n)
+{
+    for (;;) {
+        const char *p = buf + begin;
+        const char *e = buf + end;
+        int l = 0, l1 = 0, r;
+        for (r = 0; r < n; r++) {
+            // skip blank lines between records
+            while (p < e && (*p == '\n' || *p == '\r'))
+                p++;
+            l = parseRecord(p, recs[r]);
+            if (l < 0)
+                break;
+            if (r == 0)
+                l1 = l;
+            p += recs[r].raw.l;
+        }
+
+        if (r == n) {
+            begin = p - buf;
+            return l1;
+        }
+        // a record cut short by a read error is not malformed
+        if (l == -2)
+            return failed ? FASTQ_READ_ERROR : -2;
+        // refilling moves the buffer, so always scan again afterwards
+        if (!eof) {
+            fill();
+            continue;
+        }
+        if (failed)
+            return FASTQ_READ_ERROR;
+        // a partial group of records at the end is truncated input
+        return r == 0 ? -1 : -2;
+    }
+}
+
+bool FastqReader::seek(uint64_t offset, bool sequential)
+{
+    // stay inside the buffer when possible; the output pass seeks a lot
+    int64_t i = (int64_t)offset - base;
+    if (i >= (int64_t)start && i < (int64_t)end) {
+        begin = (size_t)i;
+        return true;
+    }
+
+    stopReadAhead();
+    if (gz) {
+        if (gzseek(gz, (z_off_t)offset, SEEK_SET) < 0)
+            return false;
+    }
+#ifdef HAVE_ZSTD
+    else if (zstdInput) {
+        if (!zstdSeek(offset))
+            return false;
+    }
+#endif
+    else if (lseek(fd, (off_t)offset, SEEK_SET) < 0) {
+        return false;
+    }
+    inputRead = 0;
+    outputRead = offset;
+    useOwnBuffer(offset);
+    // reading from the start means a sequential pass
+    sequential = sequential || offset == 0;
+    readSize = sequential ? BLOCK_SIZE : SEEK_BLOCK_SIZE;
+    if (sequential)
+        startReadAhead();
+    return true;
+}
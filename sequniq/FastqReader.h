@@ -0,0 +1,135 @@
+#ifndef _FASTQREADER_H_
+#define _FASTQREADER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "BlockingQueue.h"
+
+/* next() result for input that could not be read or decompressed. */
+#define FASTQ_READ_ERROR -3
+
+/* A view into the reader's buffer; not NUL terminated. */
+struct StringSpan
+{
+    const char *s;
+    size_t l;
+};
+
+/* One FastQ record. The spans point into the reader's buffer and stay valid
+ until the next call to next(), seek() or rewind(). */
+struct FastqRecord
+{
+    StringSpan raw; // the whole record as it appears in the input
+    StringSpan name, comment, seq, qual;
+    uint64_t offset; // position of the '@' in the (decompressed) input
+};
+
+/* Reads four-line FastQ records from plain, gzip or (if built with
+ HAVE_ZSTD) Zstandard compressed files. Input
+ is read in large blocks and records are located by searching for newlines
+ with SIMD compares, so nothing is copied or reallocated per record.
+ While the input is read sequentially, a read-ahead thread reads (and
+ decompresses) the next blocks in the background; seeking elsewhere stops
+ it and switches to small synchronous reads. */
+class FastqReader
+{
+public:
+    FastqReader();
+    ~FastqReader();
+
+    /* Opens path, detecting gzip and zstd input by their magic bytes. "-"
+     is standard input, which is spooled to a temporary file first. */
+    bool open(const char *path);
+    void close();
+
+    /* Return value, as for kseq_read:
+       >=0  length of the sequence
+       -1   end-of-file
+       -2   malformed or truncated record
+       FASTQ_READ_ERROR (-3)  I/O error or corrupt compressed input */
+    int next(FastqRecord &rec) { return next(&rec, 1); }
+    /* Reads two consecutive records, e.g. the mates of interleaved paired
+     input; both stay valid until the next call. Returns the length of the
+     first sequence, or a negative result as for next() (-2 also if only
+     one record is left). */
+    int nextPair(FastqRecord &rec1, FastqRecord &rec2)
+    {
+        FastqRecord recs[2];
+        int l = next(recs, 2);
+        rec1 = recs[0];
+        rec2 = recs[1];
+        return l;
+    }
+
+    /* Moves to a record start previously reported in FastqRecord::offset.
+     With `sequential`, reading goes on from there to the end, so the
+     read-ahead thread is restarted as for rewind(). */
+    bool seek(uint64_t offset, bool sequential = false);
+    bool rewind() { return seek(0); }
+
+    bool compressed() const { return gz != NULL || zstdInput; }
+    /* Size of the (decompressed) input: the file size for uncompressed
+     input, otherwise estimated from the compression ratio of what has been
+     read so far. 0 if nothing has been read yet. */
+    uint64_t estimatedSize() const;
+    /* File descriptor of uncompressed input, whose record offsets are also
+     file offsets; -1 for compressed input. */
+    int rawDescriptor() const { return compressed() ? -1 : fd; }
+
+private:
+    int fd;
+    gzFile gz;
+    bool zstdInput;
+    struct ZstdInput;
+    ZstdInput *zstd; // only used if built with HAVE_ZSTD
+    bool eof;
+    bool failed; // the input ended with a read error, not at its end
+
+    long zstdRead(char *dst, size_t n);
+    bool zstdSeek(uint64_t offset);
+
+    struct Block
+    {
+        char *data; // BLOCK_HEADROOM free bytes, then the input
+        long len;
+    };
+
+    /* Records are parsed from buf, which is either one of the read-ahead
+     blocks or `own`, the buffer for synchronous reads and for records that
+     do not fit into a block's headroom. Valid input is buf[start..end),
+     unread input buf[begin..end); buf[i] is at input position base + i. */
+    char *buf;
+    size_t capacity;
+    size_t start, begin, end;
+    int64_t base;
+    Block current; // the block buf points into, data == NULL if buf is own
+    char *own;
+    size_t ownCapacity;
+    size_t readSize; // bytes to request on the next synchronous fill
+
+    std::vector<char *> blocks;
+    BlockingQueue<Block> freeBlocks, filledBlocks;
+    std::thread readAhead;
+    std::atomic<bool> stopping;
+    // input bytes consumed and (decompressed) bytes produced by readInput()
+    std::atomic<uint64_t> inputRead, outputRead;
+
+    bool fill();
+    int parseRecord(const char *p, FastqRecord &rec);
+    int next(FastqRecord *recs, int n);
+    void useOwnBuffer(uint64_t offset);
+    long readInput(char *dst, size_t n);
+    void startReadAhead();
+    void stopReadAhead();
+    void readAheadLoop();
+
+    FastqReader(const FastqReader &);
+    FastqReader &operator=(const FastqReader &);
+};
+
+#endif // _FASTQREADER_H_
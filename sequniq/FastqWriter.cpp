@@ -0,0 +1,325 @@
+#include "FastqWriter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define OUTBUFLEN 262144
+#define WRITE_BEHIND_BUFFERS 3
+
+/* CHUNK is the size of the memory chunk used by the zlib routines. */
+
+#define CHUNK 0x4000
+
+/* These are parameters to deflateInit2. See
+ http://zlib.net/manual.html for the exact meanings. */
+
+#define windowBits 15
+#define GZIP_ENCODING 16
+
+/* zlib's error statuses are all less than zero. */
+static bool strm_init (z_stream * strm)
+{
+    strm->zalloc = Z_NULL;
+    strm->zfree  = Z_NULL;
+    strm->opaque = Z_NULL;
+    return deflateInit2 (strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         windowBits | GZIP_ENCODING, 8,
+                         Z_DEFAULT_STRATEGY) >= 0;
+}
+
+/* Writes message as one complete gzip member; concatenated members form a
+ valid gzip file. Returns false on zlib or write errors. */
+static bool compress_to_stream (const char *message, size_t length, FILE *destination) {
+    unsigned char out[CHUNK];
+    z_stream strm;
+    if (!strm_init (& strm))
+        return false;
+    strm.next_in = (unsigned char *) message;
+    strm.avail_in = (uInt) length;
+    bool ok = true;
+    do {
+        size_t have;
+        strm.avail_out = CHUNK;
+        strm.next_out = out;
+        if (deflate (& strm, Z_FINISH) < 0) {
+            ok = false;
+            break;
+        }
+        have = CHUNK - strm.avail_out;
+        if (fwrite (out, sizeof (char), have, destination) != have) {
+            ok = false;
+            break;
+        }
+    }
+    while (strm.avail_out == 0);
+    deflateEnd (& strm);
+    return ok;
+}
+
+/* Lets the kernel copy length bytes from fd at offset to out. Returns the
+ number of bytes copied, which is less than length if it gave up. */
+static uint64_t kernel_copy (int fd, uint64_t offset, uint64_t length, int out) {
+    uint64_t done = 0;
+#ifdef __linux__
+    loff_t in = (loff_t)offset;
+    while (done < length) {
+        ssize_t n = copy_file_range(fd, &in, out, NULL, length - done, 0);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    // copy_file_range needs a regular file as output; sendfile also takes pipes
+    off_t pos = (off_t)(offset + done);
+    while (done < length) {
+        ssize_t n = sendfile(out, fd, &pos, length - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+#endif
+    return done;
+}
+
+#ifdef HAVE_ZSTD
+/* Compression state; kept out of the header so that the layout of the
+ class does not depend on how the library was built. */
+struct FastqWriter::ZstdOutput
+{
+    ZSTD_CCtx *cctx;
+    char *out;
+    size_t outCapacity;
+};
+#endif
+
+FastqWriter::FastqWriter()
+    : output(NULL), compression(OUTPUT_PLAIN), direct(true), failed(false), buf(NULL), len(0), zstd(NULL)
+{
+}
+
+FastqWriter::~FastqWriter()
+{
+    close();
+    for (size_t i = 0; i < buffers.size(); i++)
+        delete [] buffers[i];
+#ifdef HAVE_ZSTD
+    if (zstd) {
+        ZSTD_freeCCtx(zstd->cctx);
+        delete [] zstd->out;
+        delete zstd;
+    }
+#endif
+}
+
+bool FastqWriter::open(const std::string &path, OutputCompression compression, int level, int threads)
+{
+    close();
+#ifndef HAVE_ZSTD
+    if (compression == OUTPUT_ZSTD) {
+        fprintf(stderr, "ERROR: sequniq was built without zstd support\n");
+        return false;
+    }
+#endif
+    this->compression = compression;
+    failed = false;
+    output = path.empty() ? stdout : fopen(path.c_str(), "w");
+    if (!output)
+        return false;
+    if (buffers.empty()) {
+        for (int i = 0; i < WRITE_BEHIND_BUFFERS; i++)
+            buffers.push_back(new char[OUTBUFLEN]);
+    }
+    for (size_t i = 1; i < buffers.size(); i++) {
+        Chunk c = { buffers[i], 0 };
+        freeBuffers.push(c);
+    }
+    buf = buffers[0];
+    len = 0;
+#ifdef HAVE_ZSTD
+    if (compression == OUTPUT_ZSTD) {
+        if (!zstd) {
+            zstd = new ZstdOutput;
+            zstd->cctx = ZSTD_createCCtx();
+            zstd->outCapacity = ZSTD_CStreamOutSize();
+            zstd->out = new char[zstd->outCapacity];
+        }
+        ZSTD_CCtx_reset(zstd->cctx, ZSTD_reset_session_only);
+        if (level)
+            ZSTD_CCtx_setParameter(zstd->cctx, ZSTD_c_compressionLevel, level);
+        // fails harmlessly if libzstd was built without multithreading
+        if (threads > 1)
+            ZSTD_CCtx_setParameter(zstd->cctx, ZSTD_c_nbWorkers, threads);
+    }
+#endif
+    writeBehind = std::thread(&FastqWriter::writeBehindLoop, this);
+    return true;
+}
+
+bool FastqWriter::close()
+{
+    if (!output)
+        return true;
+    drain();
+    Chunk stop = { NULL, 0 };
+    filledBuffers.push(stop);
+    writeBehind.join();
+    freeBuffers.clear();
+#ifdef HAVE_ZSTD
+    if (compression == OUTPUT_ZSTD && !zstdCompress(NULL, 0, true))
+        failed = true;
+#endif
+    if (output == stdout) {
+        if (fflush(output) != 0)
+            failed = true;
+    } else if (fclose(output) != 0) {
+        failed = true;
+    }
+    output = NULL;
+    return !failed;
+}
+
+void FastqWriter::writeOut(const char *data, size_t n)
+{
+    bool ok;
+    switch (compression) {
+    case OUTPUT_GZIP:
+        ok = compress_to_stream(data, n, output);
+        break;
+#ifdef HAVE_ZSTD
+    case OUTPUT_ZSTD:
+        ok = zstdCompress(data, n, false);
+        break;
+#endif
+    default:
+        ok = fwrite(data, sizeof(char), n, output) == n;
+    }
+    if (!ok)
+        failed = true;
+}
+
+#ifdef HAVE_ZSTD
+/* Unlike gzip members, the whole output is one zstd frame, which is
+ finished with ZSTD_e_end on close (`end`). */
+bool FastqWriter::zstdCompress(const char *data, size_t n, bool end)
+{
+    ZSTD_EndDirective mode = end ? ZSTD_e_end : ZSTD_e_continue;
+    ZSTD_inBuffer in = { data, n, 0 };
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = { zstd->out, zstd->outCapacity, 0 };
+        remaining = ZSTD_compressStream2(zstd->cctx, &out, &in, mode);
+        if (ZSTD_isError(remaining)) {
+            fprintf(stderr, "ERROR: zstd: %s\n", ZSTD_getErrorName(remaining));
+            return false;
+        }
+        if (fwrite(zstd->out, sizeof(char), out.pos, output) != out.pos)
+            return false;
+    } while (end ? remaining != 0 : in.pos < in.size);
+    return true;
+}
+#endif
+
+void FastqWriter::writeBehindLoop()
+{
+    for (;;) {
+        Chunk c = filledBuffers.pop();
+        if (!c.data)
+            break;
+        writeOut(c.data, c.len);
+        freeBuffers.push(c);
+    }
+}
+
+/* Hands the buffer to the write-behind thread (which also does the
+ compression) and continues in a free one. */
+void FastqWriter::flush()
+{
+    if (len == 0)
+        return;
+    Chunk c = { buf, len };
+    filledBuffers.push(c);
+    buf = freeBuffers.pop().data;
+    len = 0;
+}
+
+/* Flushes and waits until the write-behind thread has written everything,
+ so that output can be written from this thread again. */
+void FastqWriter::drain()
+{
+    flush();
+    std::vector<Chunk> idle;
+    for (size_t i = 1; i < buffers.size(); i++)
+        idle.push_back(freeBuffers.pop());
+    for (size_t i = 0; i < idle.size(); i++)
+        freeBuffers.push(idle[i]);
+}
+
+void FastqWriter::write(const char *data, size_t n)
+{
+    if (len + n > OUTBUFLEN)
+        flush();
+    if (n > OUTBUFLEN) {
+        // longer than the whole buffer: hand it over directly
+        drain();
+        writeOut(data, n);
+        return;
+    }
+    memcpy(buf + len, data, n);
+    len += n;
+}
+
+void FastqWriter::writeRecord(const FastqRecord &rec)
+{
+    write(rec.raw.s, rec.raw.l);
+    // the last record of a file may lack its newline
+    if (rec.raw.l == 0 || rec.raw.s[rec.raw.l - 1] != '\n')
+        write("\n", 1);
+}
+
+void FastqWriter::writeTagged(const FastqRecord &rec, const char *tag)
+{
+    // the header line ends after the comment, or after the name if there is none
+    const char *headerEnd = rec.comment.l ? rec.comment.s + rec.comment.l : rec.name.s + rec.name.l;
+    size_t head = headerEnd - rec.raw.s;
+    write(rec.raw.s, head);
+    write(tag, strlen(tag));
+    write(headerEnd, rec.raw.l - head);
+    if (rec.raw.s[rec.raw.l - 1] != '\n')
+        write("\n", 1);
+}
+
+bool FastqWriter::copyRange(int fd, uint64_t offset, uint64_t length)
+{
+    if (compression == OUTPUT_PLAIN && direct) {
+        drain();
+        fflush(output);
+        uint64_t done = kernel_copy(fd, offset, length, fileno(output));
+        if (done < length)
+            direct = false;
+        offset += done;
+        length -= done;
+    }
+
+    while (length > 0) {
+        if (len == OUTBUFLEN)
+            flush();
+        size_t n = OUTBUFLEN - len < length ? OUTBUFLEN - len : (size_t)length;
+        ssize_t got = pread(fd, buf + len, n, (off_t)offset);
+        if (got <= 0) {
+            failed = true;
+            return false;
+        }
+        len += got;
+        offset += got;
+        length -= got;
+    }
+    return true;
+}
@@ -0,0 +1,81 @@
+#ifndef _FASTQWRITER_H_
+#define _FASTQWRITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "BlockingQueue.h"
+#include "FastqReader.h"
+
+enum OutputCompression
+{
+    OUTPUT_PLAIN,
+    OUTPUT_GZIP,
+    OUTPUT_ZSTD // only if built with HAVE_ZSTD
+};
+
+/* Buffered FastQ output to a file or stdout, optionally gzip or zstd
+ compressed.
+ Records are written exactly as they appear in the input, including the
+ header comment and the '+' line. Full buffers are compressed and written
+ by a write-behind thread while the caller fills the next one. */
+class FastqWriter
+{
+public:
+    FastqWriter();
+    ~FastqWriter();
+
+    /* Opens path for writing; an empty path writes to stdout. level and
+     threads only apply to zstd (0 = library defaults). */
+    bool open(const std::string &path, OutputCompression compression, int level = 0, int threads = 0);
+    /* Flushes the buffer and closes the file (stdout is only flushed).
+     Returns false if anything since open() could not be written. */
+    bool close();
+
+    void write(const char *data, size_t n);
+    void writeRecord(const FastqRecord &rec);
+    /* Writes rec with tag appended to its header line. */
+    void writeTagged(const FastqRecord &rec, const char *tag);
+
+    /* Copies `length` bytes at `offset` of the uncompressed input file fd.
+     Uncompressed output is copied by the kernel (copy_file_range or
+     sendfile) without passing through user space where the system allows.
+     Returns false if the input could not be read. */
+    bool copyRange(int fd, uint64_t offset, uint64_t length);
+
+private:
+    FILE *output;
+    OutputCompression compression;
+    bool direct; // cleared once the kernel refused to copy for us
+    std::atomic<bool> failed; // set on write errors, also by the write-behind thread
+    char *buf;
+    size_t len;
+
+    struct Chunk
+    {
+        char *data;
+        size_t len;
+    };
+    std::vector<char *> buffers;
+    BlockingQueue<Chunk> freeBuffers, filledBuffers;
+    std::thread writeBehind;
+
+    struct ZstdOutput;
+    ZstdOutput *zstd; // only used if built with HAVE_ZSTD
+    bool zstdCompress(const char *data, size_t n, bool end);
+
+    void flush();
+    void drain();
+    void writeOut(const char *data, size_t n);
+    void writeBehindLoop();
+
+    FastqWriter(const FastqWriter &);
+    FastqWriter &operator=(const FastqWriter &);
+};
+
+#endif // _FASTQWRITER_H_
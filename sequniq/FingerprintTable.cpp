@@ -0,0 +1,92 @@
+#include "FingerprintTable.h"
+
+#include <string.h>
+
+static FingerprintTable::Slot *allocate_slots (size_t n, int flags, size_t *mapped) {
+    return (FingerprintTable::Slot *)arena_alloc(n * sizeof(FingerprintTable::Slot), flags, mapped);
+}
+
+FingerprintTable::FingerprintTable(int arenaFlags, size_t initialCapacity)
+    : count(0), mapped(0), flags(arenaFlags)
+{
+    size_t n = 16;
+    while (n < initialCapacity)
+        n *= 2;
+    mask = initialMask = n - 1;
+    slots = allocate_slots(n, flags, &mapped);
+}
+
+FingerprintTable::~FingerprintTable()
+{
+    arena_free(slots, mapped);
+}
+
+FingerprintTable::Slot *FingerprintTable::insert(const uint64_t *key, bool *inserted)
+{
+    if ((count + 1) * 10 > capacity() * 7 && !grow())
+        return NULL;
+
+    uint64_t k0 = key[0];
+    uint64_t k1 = (key[0] == 0 && key[1] == 0) ? 1 : key[1];
+
+    for (size_t i = k0 & mask;; i = (i + 1) & mask) {
+        Slot &s = slots[i];
+        if (s.key[0] == k0 && s.key[1] == k1) {
+            *inserted = false;
+            return &s;
+        }
+        if (empty(s)) {
+            s.key[0] = k0;
+            s.key[1] = k1;
+            count++;
+            *inserted = true;
+            return &s;
+        }
+    }
+}
+
+void FingerprintTable::clear()
+{
+    // A table grown for a large input goes back to its initial size when it
+    // was mostly empty, so that a small next input does not pay for zeroing
+    // all of it. Fresh slots are zeroed by the kernel on first touch.
+    if (mask > initialMask && count * 8 < capacity()) {
+        size_t smallMapped;
+        Slot *small = allocate_slots(initialMask + 1, flags, &smallMapped);
+        if (small) {
+            arena_free(slots, mapped);
+            slots = small;
+            mapped = smallMapped;
+            mask = initialMask;
+            count = 0;
+            return;
+        }
+    }
+    if (count > 0)
+        memset(slots, 0, capacity() * sizeof(Slot));
+    count = 0;
+}
+
+bool FingerprintTable::grow()
+{
+    Slot *old = slots;
+    size_t oldMask = mask;
+    size_t oldMapped = mapped;
+
+    Slot *larger = allocate_slots((mask + 1) * 2, flags, &mapped);
+    if (!larger)
+        return false;
+    slots = larger;
+    mask = mask * 2 + 1;
+
+    for (size_t i = 0; i <= oldMask; i++) {
+        if (empty(old[i]))
+            continue;
+        size_t j = old[i].key[0] & mask;
+        while (!empty(slots[j]))
+            j = (j + 1) & mask;
+        slots[j] = old[i];
+    }
+    arena_free(old, oldMapped);
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef _FINGERPRINTTABLE_H_
+#define _FINGERPRINTTABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "Memory.h"
+
+/* The best read seen so far for one fingerprint. */
+struct TableEntry
+{
+    uint64_t ordinal;
+    int qual;
+    uint32_t set; // duplicate set number, if the owner counts them
+};
+
+/* Hash table from 128-bit read fingerprints to the best read seen so far.
+ Keys are stored inline in a flat slot array with linear probing, so a
+ lookup touches one or two cache lines and no per-entry heap allocations
+ are made. The slot array comes from arena_alloc and doubles when it is 70%
+ full. Fingerprints are already uniformly distributed, so the first half of
+ the key is used as the hash directly. */
+class FingerprintTable
+{
+public:
+    struct Slot
+    {
+        uint64_t key[2];
+        TableEntry value;
+    };
+
+    FingerprintTable(int arenaFlags = ARENA_DEFAULT, size_t initialCapacity = 1 << 16);
+    ~FingerprintTable();
+
+    /* False if the slot array could not be allocated. */
+    bool valid() const { return slots != NULL; }
+
+    /* Returns the slot for key, claiming an empty one if the key is new;
+     `inserted` tells which of the two happened. Returns NULL if a new key
+     needs a larger slot array that could not be allocated. */
+    Slot *insert(const uint64_t *key, bool *inserted);
+    /* Empties the table. Its memory is kept for the next use, unless the
+     table grew far beyond what the last use needed. */
+    void clear();
+
+    size_t size() const { return count; }
+    size_t capacity() const { return mask + 1; }
+    size_t memory() const { return mapped; }
+
+    template <typename F>
+    void for_each(F fn) const
+    {
+        for (size_t i = 0; i <= mask; i++) {
+            if (!empty(slots[i]))
+                fn(slots[i]);
+        }
+    }
+
+private:
+    Slot *slots;
+    size_t mask;
+    size_t initialMask;
+    size_t count;
+    size_t mapped;
+    int flags;
+
+    // The all-zero key marks an empty slot, so it is stored as {0, 1}.
+    static bool empty(const Slot &s) { return s.key[0] == 0 && s.key[1] == 0; }
+    bool grow();
+
+    FingerprintTable(const FingerprintTable &);
+    FingerprintTable &operator=(const FingerprintTable &);
+};
+
+#endif // _FINGERPRINTTABLE_H_
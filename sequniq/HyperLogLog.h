@@ -0,0 +1,61 @@
+#ifndef _HYPERLOGLOG_H_
+#define _HYPERLOGLOG_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+/* HyperLogLog estimate of the number of distinct read fingerprints in
+ constant memory. The top HLL_PRECISION bits of a fingerprint select one of
+ 2^HLL_PRECISION registers, which keeps the longest run of leading zeros
+ seen in the remaining bits. With 2^16 one-byte registers the standard error
+ is 1.04 / 2^8, about 0.4%. */
+
+#define HLL_PRECISION 16
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+/* Distinct keys up to which linear counting beats the raw estimate, for
+ HLL_PRECISION 16 (Heule et al., "HyperLogLog in Practice"). */
+#define HLL_LINEAR_COUNTING_LIMIT 350000
+
+class HyperLogLog
+{
+public:
+    HyperLogLog()
+    {
+        memset(registers, 0, sizeof(registers));
+    }
+
+    void add(const uint64_t *key)
+    {
+        uint64_t h = key[1];
+        uint32_t index = (uint32_t)(h >> (64 - HLL_PRECISION));
+        // the guard bit bounds the rank if all remaining bits are zero
+        uint64_t rest = (h << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+        uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+        if (rank > registers[index])
+            registers[index] = rank;
+    }
+
+    double estimate() const
+    {
+        const double m = HLL_REGISTERS;
+        double sum = 0;
+        int zeros = 0;
+        for (int i = 0; i < HLL_REGISTERS; i++) {
+            sum += ldexp(1.0, -registers[i]);
+            zeros += registers[i] == 0;
+        }
+        // small cardinalities: linear counting is more accurate
+        if (zeros > 0) {
+            double linear = m * log(m / zeros);
+            if (linear <= HLL_LINEAR_COUNTING_LIMIT)
+                return linear;
+        }
+        return 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    }
+
+private:
+    uint8_t registers[HLL_REGISTERS];
+};
+
+#endif // _HYPERLOGLOG_H_
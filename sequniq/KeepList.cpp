@@ -0,0 +1,92 @@
+#include "KeepList.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char KEEP_LIST_MAGIC[8] = { 'S', 'Q', 'K', 'E', 'E', 'P', '0', '3' };
+
+bool keep_list_same_input(const KeepListHeader &a, const KeepListHeader &b)
+{
+    return a.seed == b.seed &&
+        a.inputBytes[0] == b.inputBytes[0] && a.inputBytes[1] == b.inputBytes[1] &&
+        a.inputHash[0] == b.inputHash[0] && a.inputHash[1] == b.inputHash[1];
+}
+
+bool write_keep_list(const char *path, KeepListHeader header, const std::vector<bool> &keep)
+{
+    FILE *out = fopen(path, "wb");
+    if (!out)
+        return false;
+
+    header.reserved = 0;
+    header.reads = keep.size();
+    header.count = 0;
+    for (size_t i = 0; i < keep.size(); i++)
+        header.count += keep[i];
+
+    fwrite(KEEP_LIST_MAGIC, 1, sizeof(KEEP_LIST_MAGIC), out);
+    fwrite(&header, sizeof(header), 1, out);
+
+    uint64_t previous = 0;
+    unsigned char varint[10];
+    for (size_t i = 0; i < keep.size(); i++) {
+        if (!keep[i])
+            continue;
+        uint64_t gap = i - previous;
+        previous = i;
+        int n = 0;
+        do {
+            varint[n++] = (gap & 0x7f) | (gap > 0x7f ? 0x80 : 0);
+            gap >>= 7;
+        } while (gap);
+        fwrite(varint, 1, n, out);
+    }
+
+    bool ok = !ferror(out);
+    return fclose(out) == 0 && ok;
+}
+
+bool read_keep_list(const char *path, KeepListHeader *header, std::vector<bool> &keep)
+{
+    FILE *in = fopen(path, "rb");
+    if (!in)
+        return false;
+
+    char magic[sizeof(KEEP_LIST_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, KEEP_LIST_MAGIC, sizeof(magic)) != 0 ||
+        fread(header, sizeof(*header), 1, in) != 1) {
+        fclose(in);
+        return false;
+    }
+    std::vector<unsigned char> data;
+    unsigned char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    bool ok = !ferror(in);
+    fclose(in);
+
+    if (keep.empty())
+        keep.assign(header->reads, false);
+    if (!ok || keep.size() != header->reads)
+        return false;
+
+    const unsigned char *p = data.data(), *end = p + data.size();
+    uint64_t ordinal = 0;
+    for (uint64_t i = 0; i < header->count; i++) {
+        uint64_t gap = 0;
+        int shift = 0;
+        do {
+            if (p == end || shift > 63)
+                return false;
+            gap |= (uint64_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        ordinal += gap;
+        if (ordinal >= keep.size())
+            return false;
+        keep[ordinal] = true;
+    }
+    return p == end;
+}
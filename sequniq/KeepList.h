@@ -0,0 +1,37 @@
+#ifndef _KEEPLIST_H_
+#define _KEEPLIST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/* A keep-list records which reads one shard of a sharded run decided to
+ keep: the ordinals of the kept reads (or pairs), in input order. After a
+ small header they are stored as LEB128 encoded gaps, which takes one or two
+ bytes per read in practice. The header also identifies the input, so that
+ the merge step does not apply the lists to other files with as many reads. */
+struct KeepListHeader
+{
+    uint32_t shard;
+    uint32_t shards;
+    uint64_t reads; // reads in the whole input, not just this shard
+    uint64_t count; // ordinals in the list
+    uint32_t seed;  // fingerprint seed of the shards
+    uint32_t reserved;
+    uint64_t inputBytes[2]; // sizes of the input files, 0 for no second file
+    uint64_t inputHash[2];  // hashes of the start of the input files
+};
+
+/* True if a and b were written with the same seed for the same input. */
+bool keep_list_same_input(const KeepListHeader &a, const KeepListHeader &b);
+
+/* Writes the ordinals of the set flags in keep, with the shard and input of
+ header; reads and count are filled in. Returns false on I/O errors. */
+bool write_keep_list(const char *path, KeepListHeader header, const std::vector<bool> &keep);
+
+/* Reads a keep-list and sets keep[ordinal] for each ordinal in it; keep is
+ sized to header->reads first if it is empty. Returns false if the file
+ cannot be read, is not a keep-list or does not fit keep. */
+bool read_keep_list(const char *path, KeepListHeader *header, std::vector<bool> &keep);
+
+#endif // _KEEPLIST_H_
@@ -0,0 +1,169 @@
+#include "Memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define MPOL_INTERLEAVE_MODE 3 // MPOL_INTERLEAVE from <numaif.h>
+#define MAX_NUMA_NODES 1024
+
+static size_t round_up (size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+#ifdef __linux__
+/* Parses /sys/devices/system/node/online ("0-1,3") into a node bit mask.
+ Returns the number of online nodes. */
+static int online_numa_nodes (unsigned long *mask, size_t words) {
+    memset(mask, 0, words * sizeof(unsigned long));
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (!f)
+        return 0;
+
+    int nodes = 0;
+    int first, last;
+    char sep;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+            if (fscanf(f, "%d", &last) != 1)
+                break;
+            if (fscanf(f, "%c", &sep) != 1)
+                sep = '\n';
+        }
+        for (int n = first; n <= last && (size_t)n < words * 8 * sizeof(unsigned long); n++) {
+            mask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+            nodes++;
+        }
+        if (sep != ',')
+            break;
+    }
+    fclose(f);
+    return nodes;
+}
+
+static void interleave_numa (void *p, size_t length) {
+    const size_t words = MAX_NUMA_NODES / (8 * sizeof(unsigned long));
+    unsigned long mask[words];
+    if (online_numa_nodes(mask, words) < 2)
+        return;
+    // Must happen before the pages are first touched; failure just leaves
+    // the default first-touch policy in place.
+    syscall(SYS_mbind, p, length, MPOL_INTERLEAVE_MODE, mask, (unsigned long)MAX_NUMA_NODES + 1, 0);
+}
+#endif
+
+void *arena_alloc(size_t bytes, int flags, size_t *mapped)
+{
+    void *p = MAP_FAILED;
+    size_t length = round_up(bytes, getpagesize());
+    bool huge = (flags & ARENA_HUGEPAGES) && bytes >= HUGE_PAGE_SIZE;
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages only succeed if the administrator reserved some.
+    if (huge && !(flags & ARENA_FORKABLE)) {
+        length = round_up(bytes, HUGE_PAGE_SIZE);
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+
+    if (p == MAP_FAILED && huge) {
+        // Map with slack and trim it, so that the region is huge page aligned
+        // and transparent huge pages can back all of it.
+        size_t slack = length + HUGE_PAGE_SIZE;
+        char *raw = (char *)mmap(NULL, slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED) {
+            char *aligned = (char *)round_up((size_t)raw, HUGE_PAGE_SIZE);
+            if (aligned > raw)
+                munmap(raw, aligned - raw);
+            if (raw + slack > aligned + length)
+                munmap(aligned + length, raw + slack - (aligned + length));
+            p = aligned;
+#ifdef MADV_HUGEPAGE
+            madvise(p, length, MADV_HUGEPAGE);
+#endif
+        }
+    }
+
+    if (p == MAP_FAILED) {
+        length = round_up(bytes, getpagesize());
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+    }
+
+#ifdef __linux__
+    if (flags & ARENA_INTERLEAVE)
+        interleave_numa(p, length);
+#endif
+
+    *mapped = length;
+    return p;
+}
+
+void arena_free(void *p, size_t mapped)
+{
+    if (p)
+        munmap(p, mapped);
+}
+
+TlbCounter::TlbCounter() : fd(-1)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // also count threads started later, e.g. those of the radix sort
+    attr.inherit = 1;
+    fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+TlbCounter::~TlbCounter()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+void TlbCounter::start()
+{
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+int64_t TlbCounter::stop()
+{
+    int64_t count = -1;
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+#endif
+    return count;
+}
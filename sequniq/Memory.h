@@ -0,0 +1,45 @@
+#ifndef _MEMORY_H_
+#define _MEMORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Large allocations for the fingerprint table. Lookups into the table are
+ random, so with 4 KB pages nearly every probe misses the TLB. Memory from
+ arena_alloc is mapped directly from the kernel and can be backed by huge
+ pages and spread over all NUMA nodes, instead of landing on the node of
+ whichever thread touched it first. Both are best effort: when the system
+ does not support them, plain pages are used. */
+
+#define ARENA_HUGEPAGES  1   // explicit huge pages if reserved, else transparent ones
+#define ARENA_INTERLEAVE 2   // interleave pages across all online NUMA nodes
+#define ARENA_DEFAULT    (ARENA_HUGEPAGES | ARENA_INTERLEAVE)
+/* The memory is shared copy-on-write with fork()ed children, so explicit
+ huge pages are not used: if no spare one is reserved when the parent writes
+ to a shared page, the kernel kills the child. Transparent ones still are. */
+#define ARENA_FORKABLE   4
+
+/* Returns zero-filled memory of at least `bytes`, or NULL on failure. The
+ size actually mapped is stored in `mapped` and must be passed to arena_free. */
+void *arena_alloc(size_t bytes, int flags, size_t *mapped);
+void arena_free(void *p, size_t mapped);
+
+/* Counts data TLB misses of the calling thread and the threads it starts
+ between start and stop, using the hardware performance counters where the
+ kernel exposes them. */
+class TlbCounter
+{
+public:
+    TlbCounter();
+    ~TlbCounter();
+
+    bool available() const { return fd >= 0; }
+    void start();
+    /* Returns the number of misses since start(), or -1 if unavailable. */
+    int64_t stop();
+
+private:
+    int fd;
+};
+
+#endif // _MEMORY_H_
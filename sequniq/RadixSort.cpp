@@ -0,0 +1,125 @@
+#include "RadixSort.h"
+
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+/* Below this many records per thread, spawning threads costs more than it saves. */
+#define MIN_RECORDS_PER_THREAD 65536
+
+typedef size_t Histogram[RADIX_PASSES][RADIX_BUCKETS];
+typedef size_t Counts[RADIX_BUCKETS];
+
+template <typename F>
+static void parallel_for (int threads, F fn) {
+    if (threads == 1) {
+        fn(0);
+        return;
+    }
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++)
+        pool.push_back(std::thread(fn, t));
+    for (size_t t = 0; t < pool.size(); t++)
+        pool[t].join();
+}
+
+static bool hash_less (const FingerprintRecord &a, const FingerprintRecord &b) {
+    return a.hash[1] < b.hash[1];
+}
+
+void radix_sort_records(FingerprintRecord *records, size_t n, int threads)
+{
+    if (n < 2)
+        return;
+
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > n / MIN_RECORDS_PER_THREAD)
+        threads = std::max<size_t>(1, n / MIN_RECORDS_PER_THREAD);
+
+    std::vector<size_t> bounds(threads + 1);
+    for (int t = 0; t <= threads; t++)
+        bounds[t] = n * t / threads;
+
+    // Count the digits of all passes in a single read of the input. Summed
+    // over the threads this tells which passes can be skipped; which thread
+    // sees which records changes with every pass, though.
+    Histogram *counts = new Histogram[threads];
+    memset(counts, 0, sizeof(Histogram) * threads);
+
+    parallel_for(threads, [&](int t) {
+        Histogram &h = counts[t];
+        for (size_t i = bounds[t]; i < bounds[t + 1]; i++) {
+            uint64_t key = records[i].hash[0];
+            for (int pass = 0; pass < RADIX_PASSES; pass++)
+                h[pass][(key >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+        }
+    });
+
+    FingerprintRecord *src = records;
+    FingerprintRecord *dst = new FingerprintRecord[n];
+    Counts *pos = new Counts[threads];
+
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        int shift = pass * RADIX_BITS;
+
+        // A pass in which every key has the same digit would not move anything.
+        size_t total = 0;
+        for (int t = 0; t < threads; t++)
+            total += counts[t][pass][(src[0].hash[0] >> shift) & (RADIX_BUCKETS - 1)];
+        if (total == n)
+            continue;
+
+        // Count the digits of each thread's slice of the current order, then
+        // turn the counts into per-thread write positions; threads write their
+        // share of each bucket in order, which keeps the sort stable.
+        if (threads > 1) {
+            parallel_for(threads, [&](int t) {
+                memset(pos[t], 0, sizeof(Counts));
+                for (size_t i = bounds[t]; i < bounds[t + 1]; i++)
+                    pos[t][(src[i].hash[0] >> shift) & (RADIX_BUCKETS - 1)]++;
+            });
+        } else {
+            memcpy(pos[0], counts[0][pass], sizeof(Counts));
+        }
+        size_t offset = 0;
+        for (int d = 0; d < RADIX_BUCKETS; d++) {
+            for (int t = 0; t < threads; t++) {
+                size_t c = pos[t][d];
+                pos[t][d] = offset;
+                offset += c;
+            }
+        }
+
+        parallel_for(threads, [&](int t) {
+            size_t *next = pos[t];
+            for (size_t i = bounds[t]; i < bounds[t + 1]; i++)
+                dst[next[(src[i].hash[0] >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
+        });
+
+        std::swap(src, dst);
+    }
+
+    if (src != records) {
+        memcpy(records, src, n * sizeof(FingerprintRecord));
+        dst = src;
+    }
+    delete [] dst;
+    delete [] counts;
+    delete [] pos;
+
+    // Order runs of equal hash[0] by the second half of the fingerprint.
+    size_t start = 0;
+    for (size_t i = 1; i <= n; i++) {
+        if (i == n || records[i].hash[0] != records[start].hash[0]) {
+            if (i - start > 1)
+                std::stable_sort(records + start, records + i, hash_less);
+            start = i;
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef _RADIXSORT_H_
+#define _RADIXSORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* One read (or read pair) as seen by the sort engine: its 128-bit
+ fingerprint, its position in the input and its quality score. */
+struct FingerprintRecord
+{
+    uint64_t hash[2];
+    uint64_t ordinal;
+    int qual;
+};
+
+/* Sorts records by fingerprint with a parallel LSD radix sort. The sort is
+ stable, so records with equal fingerprints stay in input (ordinal) order.
+ Only hash[0] is used as radix key; runs with equal hash[0] are then ordered
+ by hash[1] with a comparison sort, as they are tiny in practice. */
+void radix_sort_records(FingerprintRecord *records, size_t n, int threads);
+
+#endif // _RADIXSORT_H_
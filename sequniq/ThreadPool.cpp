@@ -0,0 +1,94 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int threads)
+    : queued(0), pending(0), next(0), stopping(false)
+{
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++)
+        queues.push_back(new Queue);
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&ThreadPool::run, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    for (size_t i = 0; i < queues.size(); i++)
+        delete queues[i];
+}
+
+void ThreadPool::submit(const Task &task)
+{
+    Queue *q;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+        q = queues[next];
+        next = (next + 1) % queues.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(q->mutex);
+        q->tasks.push_back(task);
+    }
+    {
+        // under the lock, so a worker cannot miss the wakeup between its
+        // check of `queued` and its wait
+        std::lock_guard<std::mutex> lock(mutex);
+        queued++;
+    }
+    work.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending > 0)
+        done.wait(lock);
+}
+
+/* Takes the oldest task of the worker's own deque, or else of the next
+ non-empty deque. Tasks thus start in the order they were submitted, which
+ lets callers put the longest ones first. */
+bool ThreadPool::take(int worker, Task &task)
+{
+    size_t n = queues.size();
+    for (size_t i = 0; i < n; i++) {
+        Queue *q = queues[(worker + i) % n];
+        std::lock_guard<std::mutex> lock(q->mutex);
+        if (q->tasks.empty())
+            continue;
+        task = q->tasks.front();
+        q->tasks.pop_front();
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::run(int worker)
+{
+    Task task;
+    for (;;) {
+        if (take(worker, task)) {
+            task(worker);
+            task = Task();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                done.notify_all();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        while (queued == 0 && !stopping)
+            work.wait(lock);
+        if (stopping && queued == 0)
+            return;
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fixed set of worker threads with one task deque each. submit() deals the
+ tasks out round robin; a worker runs the tasks of its own deque in order
+ and, once that is empty, steals the oldest task of another one, so workers
+ that drew short tasks take over the rest instead of idling. Tasks are
+ passed the number of the worker running them, to index per-worker state. */
+class ThreadPool
+{
+public:
+    typedef std::function<void(int worker)> Task;
+
+    ThreadPool(int threads);
+    /* Waits for all tasks and stops the workers. */
+    ~ThreadPool();
+
+    int size() const { return (int)workers.size(); }
+    void submit(const Task &task);
+    /* Returns when every task submitted so far has run. */
+    void wait();
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<Queue *> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work, done;
+    std::atomic<size_t> queued; // tasks in the deques
+    size_t pending;             // tasks submitted but not finished
+    size_t next;                // deque for the next submit()
+    bool stopping;
+
+    bool take(int worker, Task &task);
+    void run(int worker);
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+};
+
+#endif // _THREADPOOL_H_
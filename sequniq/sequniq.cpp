@@ -1,128 +1,652 @@
-#include <zlib.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <string>
 #include <iostream>
 #include <algorithm>
-#include <unordered_map>
+#include <vector>
+#include <set>
+#include <thread>
 
-#include "kseq.h"
+#include "BarcodeSheet.h"
+#include "Checkpoint.h"
+#include "Deduplicator.h"
+#include "FastqReader.h"
+#include "FastqWriter.h"
+#include "HyperLogLog.h"
+#include "KeepList.h"
+#include "Memory.h"
 #include "MurmurHash3.h"
+#include "ThreadPool.h"
 #include <tclap/CmdLine.h>
 
-#if __x86_64__
-/* 64-bit */
-#define murmur(k, l, s, o) MurmurHash3_x64_128(k, l, s, o)
-#else
-#define murmur(k, l, s, o) MurmurHash3_x86_128(k, l, s, o)
-#endif
-
 //using namespace std;
 
-KSEQ_INIT(gzFile, gzread)
+#define PAIR_MISMATCH -4
+/* feed_reads result if the hash table could not grow. */
+#define OUT_OF_MEMORY -5
 
-/* CHUNK is the size of the memory chunk used by the zlib routines. */
+/* Fixed fingerprint seed for sharded runs, whose processes must agree on
+ the fingerprints even on different machines. */
+#define SHARD_SEED 0x5e9a1c3bU
 
-#define CHUNK 0x4000
+/* Reads the next record, or pair of records if in2 is set. in2 == in1 means
+ interleaved input with the mates in consecutive records. Returns the length
+ of the first read, -1 at the end of the input, -2 for malformed input,
+ FASTQ_READ_ERROR or PAIR_MISMATCH if the second file ran out early. */
+int read_record (FastqReader *in1, FastqReader *in2, FastqRecord &rec1, FastqRecord &rec2) {
+    if (in2 == in1)
+        return in1->nextPair(rec1, rec2);
+    
+    int l1 = in1->next(rec1);
+    if (l1 < 0 || !in2)
+        return l1;
+    int l2 = in2->next(rec2);
+    if (l2 == FASTQ_READ_ERROR)
+        return l2;
+    if (l2 < 0)
+        return PAIR_MISMATCH;
+    return l1;
+}
 
-/* The following macro calls a zlib routine and checks the return
- value. If the return value ("status") is not OK, it prints an error
- message and exits the program. Zlib's error statuses are all less
- than zero. */
+/* Rewinds the input for another pass. */
+void rewind_input (FastqReader *in1, FastqReader *in2) {
+    in1->rewind();
+    if (in2 && in2 != in1)
+        in2->rewind();
+}
 
-#define CALL_ZLIB(x) {                                              \
-    int status;                                                     \
-    status = x;                                                     \
-    if (status < 0) {                                               \
-        fprintf (stderr,                                            \
-                 "%s:%d: %s returned a bad status of %d.\n",        \
-                 __FILE__, __LINE__, #x, status);                   \
-        exit (EXIT_FAILURE);                                        \
-    }                                                               \
+/* Passes every read to dedup, or to its prescan() for the Bloom pre-pass.
+ Returns -1 at the end of the input, OUT_OF_MEMORY if dedup could not take
+ a read, else the failed read_record result. */
+int feed_reads (FastqReader *in1, FastqReader *in2, Deduplicator &dedup, bool prescan) {
+    FastqRecord rec1, rec2;
+    int l;
+    while ((l = read_record(in1, in2, rec1, rec2)) >= 0) {
+        if (prescan)
+            dedup.prescan(rec1, in2 ? &rec2 : NULL);
+        else if (!dedup.add(rec1, in2 ? &rec2 : NULL))
+            return OUT_OF_MEMORY;
+    }
+    return l;
 }
 
-/* These are parameters to deflateInit2. See
- http://zlib.net/manual.html for the exact meanings. */
+/* Consecutive failed checkpoints after which a run stops trying. */
+#define MAX_CHECKPOINT_FAILURES 3
 
-#define windowBits 15
-#define GZIP_ENCODING 16
+/* feed_reads for the fingerprint pass with checkpoints: every `interval`
+ seconds, the state after the current read is written to path in the
+ background, unless the previous checkpoint is still being written. Failed
+ checkpoints are reported, and after MAX_CHECKPOINT_FAILURES in a row the
+ run goes on without them. */
+int feed_reads_checkpointed (FastqReader *in1, FastqReader *in2, Deduplicator &dedup,
+                             const std::string &path, CheckpointHeader header, int interval) {
+    FastqRecord rec1, rec2;
+    time_t last = time(NULL);
+    pid_t child = -1;
+    int failures = 0;
+    uint64_t reads = 0;
+    int l;
+    
+    auto failed = [&](const char *what) {
+        fprintf(stderr, "WARNING: could not %s the checkpoint %s\n", what, path.c_str());
+        if (++failures == MAX_CHECKPOINT_FAILURES)
+            fprintf(stderr, "WARNING: %d checkpoints failed in a row, continuing without\n", failures);
+    };
+    // returns false while the last checkpoint is still being written
+    auto reap = [&](bool wait) {
+        if (child <= 0)
+            return true;
+        int result = finish_checkpoint(child, wait);
+        if (result == 0)
+            return false;
+        child = -1;
+        if (result > 0)
+            failures = 0;
+        else
+            failed("write");
+        return true;
+    };
+    
+    while ((l = read_record(in1, in2, rec1, rec2)) >= 0) {
+        if (!dedup.add(rec1, in2 ? &rec2 : NULL)) {
+            l = OUT_OF_MEMORY;
+            break;
+        }
+        // looking at the clock every 64k reads is plenty
+        if ((++reads & 0xffff) != 0 || failures >= MAX_CHECKPOINT_FAILURES || time(NULL) - last < interval)
+            continue;
+        if (!reap(false) || failures >= MAX_CHECKPOINT_FAILURES)
+            continue;
+        if (in2 == in1) {
+            header.offset[0] = rec2.offset + rec2.raw.l;
+            header.offset[1] = 0;
+        } else {
+            header.offset[0] = rec1.offset + rec1.raw.l;
+            header.offset[1] = in2 ? rec2.offset + rec2.raw.l : 0;
+        }
+        child = start_checkpoint(path.c_str(), header, dedup);
+        if (child < 0)
+            failed("start writing");
+        last = time(NULL);
+    }
+    reap(true);
+    return l;
+}
 
-static void strm_init (z_stream * strm)
-{
-    strm->zalloc = Z_NULL;
-    strm->zfree  = Z_NULL;
-    strm->opaque = Z_NULL;
-    CALL_ZLIB (deflateInit2 (strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-                             windowBits | GZIP_ENCODING, 8,
-                             Z_DEFAULT_STRATEGY));
+/* Size of a file, 0 if it cannot be determined. */
+uint64_t file_size (const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
 }
 
-std::hash<uint64_t> longHash;
+/* Bytes at the start of an input file that identify it in keep-lists. */
+#define INPUT_HASH_BYTES (1 << 20)
 
-struct MurmurHash128
-{
-    uint64_t* p;
-    size_t size;
-    
-    bool operator==(const MurmurHash128 &other) const
-    {
-        return size == other.size && memcmp(p, other.p, size) == 0;
+/* Hash of the first INPUT_HASH_BYTES of a file as stored, 0 for standard
+ input or if it cannot be read. */
+uint64_t file_hash (const std::string &path, uint32_t seed) {
+    FILE *f = path == "-" ? NULL : fopen(path.c_str(), "rb");
+    if (!f)
+        return 0;
+    std::vector<char> data(INPUT_HASH_BYTES);
+    size_t n = fread(data.data(), 1, data.size(), f);
+    fclose(f);
+    uint64_t hash[2];
+    MurmurHash3_x64_128(data.data(), (int)n, seed, hash);
+    return hash[0];
+}
+
+/* Fills in the input part of a keep-list header. */
+void keep_list_input (KeepListHeader *header, uint32_t seed, const std::string &input1, const std::string &input2) {
+    header->seed = seed;
+    header->inputBytes[0] = file_size(input1);
+    header->inputHash[0] = file_hash(input1, seed);
+    header->inputBytes[1] = input2 != "" ? file_size(input2) : 0;
+    header->inputHash[1] = input2 != "" ? file_hash(input2, seed) : 0;
+}
+
+/* Reports a read_record or feed_reads failure; `sample` names the batch
+ sample, if any. */
+void report_input_error (int l, const std::string &sample) {
+    std::string where = sample == "" ? "" : "sample " + sample + ": ";
+    if (l == OUT_OF_MEMORY)
+        fprintf(stderr, "ERROR: %scould not allocate memory for the fingerprint table\n", where.c_str());
+    else if (l == FASTQ_READ_ERROR)
+        fprintf(stderr, "ERROR: %scould not read the input (read error or corrupt compressed file)\n", where.c_str());
+    else if (l == PAIR_MISMATCH)
+        fprintf(stderr, "ERROR: %spaired-end files have different length\n", where.c_str());
+    else
+        fprintf(stderr, "ERROR: %smalformed FastQ record\n", where.c_str());
+}
+
+/* Output file names for prefix: name2 is only set if the mates of paired
+ input go to separate files. */
+void output_names (const std::string &prefix, bool separateMates, OutputCompression compression,
+                   std::string &name1, std::string &name2) {
+    if (separateMates) {
+        name1 = prefix + "_1.fastq";
+        name2 = prefix + "_2.fastq";
+    } else {
+        name1 = prefix + ".fastq";
+        name2 = "";
     }
-};
+    const char *suffix = compression == OUTPUT_GZIP ? ".gz" : compression == OUTPUT_ZSTD ? ".zst" : "";
+    name1.append(suffix);
+    if (separateMates)
+        name2.append(suffix);
+}
 
-namespace std {
-    template <>
-    struct hash<MurmurHash128>
-    {
-        typedef MurmurHash128 argument_type;
-        typedef std::size_t result_type;
-        result_type operator()(argument_type const& dr) const
-        {
-            result_type h = 0;
-            for (uint64_t* p = dr.p; p != dr.p + dr.size; ++p)
-                h ^= longHash(*p);
-            return h;
+/* The output pass: reads the input once more and writes the reads whose
+ keep flag is set, or with `mark` all reads with a tag. Removed reads also
+ go to `duplicates` if it is set. Returns false if the input does not have
+ keep.size() reads. */
+bool write_output (FastqReader *fp1, FastqReader *fp2, const std::vector<bool> &keep, const std::vector<uint32_t> &setSizes, bool mark,
+                   FastqWriter *output1, FastqWriter *output2, FastqWriter *duplicates) {
+    FastqRecord rec1, rec2;
+    bool interleaved = fp2 == fp1;
+    
+    char tag[32];
+    auto emit = [&](bool kept, uint32_t dupset) {
+        if (mark) {
+            snprintf(tag, sizeof(tag), kept ? " dupset=%u" : " DUP dupset=%u", dupset);
+            output1->writeTagged(rec1, tag);
+            if (fp2)
+                output2->writeTagged(rec2, tag);
+        } else if (kept) {
+            output1->writeRecord(rec1);
+            if (fp2)
+                output2->writeRecord(rec2);
+        }
+        if (!kept && duplicates) {
+            duplicates->writeRecord(rec1);
+            if (fp2)
+                duplicates->writeRecord(rec2);
         }
     };
+    
+    /* Long runs of kept reads from uncompressed files are copied as one
+     byte range, which the writer can leave to the kernel. Two input files
+     interleaved into one output need record by record copies, tagged output
+     anyway. */
+    bool ranges = !mark && fp1->rawDescriptor() >= 0 && (!fp2 || interleaved || (fp2->rawDescriptor() >= 0 && output2 != output1));
+    const size_t MIN_RUN = 64;
+    
+    size_t ordinal = 0;
+    while (ordinal < keep.size()) {
+        if (read_record(fp1, fp2, rec1, rec2) < 0)
+            break;
+        if (!keep[ordinal]) {
+            emit(false, setSizes.empty() ? 0 : setSizes[ordinal]);
+            ordinal++;
+            continue;
+        }
+        
+        size_t run = 1;
+        while (ranges && run < MIN_RUN && ordinal + run < keep.size() && keep[ordinal + run])
+            run++;
+        
+        if (run < MIN_RUN) {
+            emit(true, setSizes.empty() ? 0 : setSizes[ordinal]);
+            ordinal++;
+            continue;
+        }
+        
+        // walk to the end of the run; only the parser touches the bytes
+        uint64_t start1 = rec1.offset, start2 = fp2 ? rec2.offset : 0;
+        bool complete1 = true, complete2 = true;
+        for (;;) {
+            complete1 = rec1.raw.s[rec1.raw.l - 1] == '\n';
+            if (fp2)
+                complete2 = rec2.raw.s[rec2.raw.l - 1] == '\n';
+            ordinal++;
+            if (ordinal == keep.size() || !keep[ordinal])
+                break;
+            if (read_record(fp1, fp2, rec1, rec2) < 0)
+                break;
+        }
+        if (interleaved) {
+            // both mates of every pair in the run form one range
+            if (!output1->copyRange(fp1->rawDescriptor(), start1, rec2.offset + rec2.raw.l - start1))
+                return false;
+            if (!complete2)
+                output1->write("\n", 1);
+            continue;
+        }
+        if (!output1->copyRange(fp1->rawDescriptor(), start1, rec1.offset + rec1.raw.l - start1))
+            return false;
+        if (!complete1)
+            output1->write("\n", 1); // last record of a file without newline
+        if (fp2) {
+            if (!output2->copyRange(fp2->rawDescriptor(), start2, rec2.offset + rec2.raw.l - start2))
+                return false;
+            if (!complete2)
+                output2->write("\n", 1);
+        }
+    }
+    return ordinal == keep.size() && read_record(fp1, fp2, rec1, rec2) == -1;
 }
 
-struct OffsetPair
+/* One line of a batch manifest: a sample name and its one or two input
+ files. */
+struct BatchSample
 {
-    long offset1;
-    long offset2;
-    int qual;
+    std::string name, input1, input2;
+    uint64_t bytes; // input size, to start the largest samples first
 };
 
-int calculate_score (const char *scoreString) {
+/* Settings shared by all samples of a batch or demultiplexed run. */
+struct BatchSettings
+{
+    std::string prefix;
+    bool interleaved;
+    bool mark;
+    bool bloom; // the deduplicators have a Bloom filter pre-pass
+    OutputCompression compression;
+    int zstdLevel;
+};
+
+/* The state a pool worker reuses from sample to sample: the deduplicator
+ with its table, and the reader and writer buffers. */
+struct BatchWorker
+{
+    Deduplicator dedup;
+    FastqReader reader1, reader2;
+    FastqWriter writer1, writer2;
+    
+    BatchWorker(const DedupOptions &options) : dedup(options) {}
+};
+
+/* Reads a manifest with one sample per line: name, first file and for
+ paired-end input the second file, separated by white space. Blank lines
+ and lines starting with '#' are skipped. */
+bool read_manifest (const char *path, std::vector<BatchSample> &samples) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: could not open %s\n", path);
+        return false;
+    }
+    std::set<std::string> names;
+    char line[4096];
+    int lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineNumber++;
+        std::vector<std::string> fields;
+        for (char *field = strtok(line, " \t\r\n"); field; field = strtok(NULL, " \t\r\n"))
+            fields.push_back(field);
+        if (fields.empty() || fields[0][0] == '#')
+            continue;
+        if (fields.size() < 2 || fields.size() > 3) {
+            fprintf(stderr, "ERROR: %s:%d: expected a sample name and one or two files\n", path, lineNumber);
+            ok = false;
+            break;
+        }
+        if (!names.insert(fields[0]).second) {
+            // both would be written to the same output files
+            fprintf(stderr, "ERROR: %s:%d: sample %s is listed twice\n", path, lineNumber, fields[0].c_str());
+            ok = false;
+            break;
+        }
+        BatchSample sample;
+        sample.name = fields[0];
+        sample.input1 = fields[1];
+        sample.input2 = fields.size() == 3 ? fields[2] : "";
+        sample.bytes = 0;
+        for (size_t i = 1; i < fields.size(); i++) {
+            struct stat st;
+            if (stat(fields[i].c_str(), &st) == 0)
+                sample.bytes += st.st_size;
+        }
+        samples.push_back(sample);
+    }
+    fclose(f);
+    return ok;
+}
+
+/* Deduplicates one sample of a batch into <prefix><name>.fastq (or _1/_2
+ for paired-end input) and resets the worker for the next one. Returns the
+ exit code for the sample. */
+int dedup_sample (const BatchSample &sample, BatchWorker &worker, const BatchSettings &settings) {
+    const char *name = sample.name.c_str();
+    FastqReader *fp1 = &worker.reader1;
+    FastqReader *fp2 = NULL;
     int result = 0;
-    while (*scoreString){
-        result += *scoreString - 33;
-        scoreString++;
+    
+    if (!worker.reader1.open(sample.input1.c_str())) {
+        fprintf(stderr, "ERROR: sample %s: could not open %s\n", name, sample.input1.c_str());
+        return 1;
     }
+    if (sample.input2 != "") {
+        if (!worker.reader2.open(sample.input2.c_str())) {
+            fprintf(stderr, "ERROR: sample %s: could not open %s\n", name, sample.input2.c_str());
+            worker.reader1.close();
+            return 1;
+        }
+        fp2 = &worker.reader2;
+    } else if (settings.interleaved) {
+        fp2 = fp1;
+    }
+    
+    int l = -1;
+    if (!worker.dedup.valid()) {
+        fprintf(stderr, "ERROR: sample %s: could not allocate the Bloom filter or the fingerprint table\n", name);
+        result = 2;
+    } else if (settings.bloom) {
+        l = feed_reads(fp1, fp2, worker.dedup, true);
+        rewind_input(fp1, fp2);
+    }
+    if (result == 0 && l == -1)
+        l = feed_reads(fp1, fp2, worker.dedup, false);
+    if (result == 0 && l != -1) {
+        report_input_error(l, sample.name);
+        result = 2;
+    }
+    
+    if (result == 0) {
+        worker.dedup.finish();
+        
+        std::string outfileName1, outfileName2;
+        bool separateMates = fp2 && fp2 != fp1;
+        output_names(settings.prefix + sample.name, separateMates, settings.compression, outfileName1, outfileName2);
+        // one zstd thread per sample: the pool already keeps all cores busy
+        if (!worker.writer1.open(outfileName1, settings.compression, settings.zstdLevel, 1) ||
+            (separateMates && !worker.writer2.open(outfileName2, settings.compression, settings.zstdLevel, 1))) {
+            fprintf(stderr, "ERROR: sample %s: could not open its output for writing\n", name);
+            result = 1;
+        } else {
+            rewind_input(fp1, fp2);
+            if (!write_output(fp1, fp2, worker.dedup.keepFlags(), worker.dedup.setSizes(), settings.mark,
+                              &worker.writer1, separateMates ? &worker.writer2 : &worker.writer1, NULL)) {
+                fprintf(stderr, "ERROR: sample %s: the input changed while it was read\n", name);
+                result = 2;
+            }
+        }
+        bool written = worker.writer1.close();
+        written = worker.writer2.close() && written;
+        if (result == 0 && !written) {
+            fprintf(stderr, "ERROR: sample %s: could not write its output\n", name);
+            result = 1;
+        }
+    }
+    
+    worker.reader1.close();
+    worker.reader2.close();
+    worker.dedup.reset();
     return result;
 }
 
-void compress_to_stream (char *message, FILE *destination) {
-    unsigned char out[CHUNK];
-    z_stream strm;
-    strm_init (& strm);
-    strm.next_in = (unsigned char *) message;
-    strm.avail_in = strlen (message);
-    do {
-        int have;
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
-        CALL_ZLIB (deflate (& strm, Z_FINISH));
-        have = CHUNK - strm.avail_out;
-        fwrite (out, sizeof (char), have, destination);
-    }
-    while (strm.avail_out == 0);
-    deflateEnd (& strm);
+/* Batch mode: deduplicates every sample of the manifest on a shared pool
+ of threads, one sample per task, largest first. Returns the highest exit
+ code of any sample; the others are still processed. */
+int run_batch (std::vector<BatchSample> &samples, const BatchSettings &settings, const DedupOptions &options, int threads) {
+    std::stable_sort(samples.begin(), samples.end(), [](const BatchSample &a, const BatchSample &b) {
+        return a.bytes > b.bytes;
+    });
+    
+    int workers = std::min((size_t)threads, samples.size());
+    std::vector<BatchWorker *> state;
+    for (int i = 0; i < workers; i++)
+        state.push_back(new BatchWorker(options));
+    
+    std::vector<int> results(samples.size(), 0);
+    {
+        ThreadPool pool(workers);
+        for (size_t i = 0; i < samples.size(); i++) {
+            pool.submit([&, i](int worker) {
+                results[i] = dedup_sample(samples[i], *state[worker], settings);
+            });
+        }
+        pool.wait();
+    }
+    
+    for (int i = 0; i < workers; i++)
+        delete state[i];
+    return samples.empty() ? 0 : *std::max_element(results.begin(), results.end());
+}
+
+/* Demultiplexing: routes every read by its index sequence, taken from the
+ header or from index FastQ files read alongside the input, to the
+ deduplicator of its sample. The output pass writes <prefix><sample>.fastq
+ (or _1/_2) for every sample of the sheet and <prefix>undetermined.fastq
+ for reads without a matching barcode, all deduplicated per sample. */
+int demultiplex (FastqReader *fp1, FastqReader *fp2, std::vector<FastqReader *> &indexReaders,
+                 const BarcodeSheet &sheet, const BatchSettings &settings, const DedupOptions &options) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < sheet.samples(); i++)
+        names.push_back(sheet.name(i));
+    names.push_back("undetermined");
+    size_t samples = names.size();
+    
+    std::vector<Deduplicator *> dedups;
+    for (size_t i = 0; i < samples; i++)
+        dedups.push_back(new Deduplicator(options));
+    // the sample of every read, so the output pass does not route again
+    std::vector<uint16_t> route;
+    
+    FastqRecord rec1, rec2, indexRec;
+    std::string joined;
+    int result = 0;
+    int l = -1;
+    for (size_t i = 0; i < samples; i++) {
+        if (!dedups[i]->valid()) {
+            fprintf(stderr, "ERROR: could not allocate the Bloom filter or the fingerprint table\n");
+            result = 2;
+            break;
+        }
+    }
+    while (result == 0 && (l = read_record(fp1, fp2, rec1, rec2)) >= 0) {
+        StringSpan index;
+        if (indexReaders.empty()) {
+            index = BarcodeSheet::headerIndex(rec1);
+        } else {
+            // i7 and i5 reads are joined as in the headers
+            joined.clear();
+            for (size_t i = 0; i < indexReaders.size(); i++) {
+                if (indexReaders[i]->next(indexRec) < 0) {
+                    fprintf(stderr, "ERROR: the index files have fewer reads than the input\n");
+                    result = 2;
+                    break;
+                }
+                if (i > 0)
+                    joined += '+';
+                joined.append(indexRec.seq.s, indexRec.seq.l);
+            }
+            index.s = joined.data();
+            index.l = joined.size();
+        }
+        int sample = sheet.lookup(index.s, index.l);
+        if (sample < 0)
+            sample = (int)samples - 1;
+        route.push_back((uint16_t)sample);
+        if (!dedups[sample]->add(rec1, fp2 ? &rec2 : NULL)) {
+            l = OUT_OF_MEMORY;
+            break;
+        }
+    }
+    if (result == 0 && l != -1) {
+        report_input_error(l, "");
+        result = 2;
+    }
+    for (size_t i = 0; result == 0 && i < indexReaders.size(); i++) {
+        if (indexReaders[i]->next(indexRec) != -1) {
+            fprintf(stderr, "ERROR: the index files have more reads than the input\n");
+            result = 2;
+        }
+    }
+    
+    std::vector<FastqWriter *> writers1, writers2;
+    bool separateMates = fp2 && fp2 != fp1;
+    for (size_t i = 0; result == 0 && i < samples; i++) {
+        dedups[i]->finish();
+        std::string outfileName1, outfileName2;
+        output_names(settings.prefix + names[i], separateMates, settings.compression, outfileName1, outfileName2);
+        writers1.push_back(new FastqWriter);
+        writers2.push_back(separateMates ? new FastqWriter : NULL);
+        // with many samples, a compression thread each is plenty
+        if (!writers1[i]->open(outfileName1, settings.compression, settings.zstdLevel, 1) ||
+            (separateMates && !writers2[i]->open(outfileName2, settings.compression, settings.zstdLevel, 1))) {
+            fprintf(stderr, "ERROR: could not open the output of sample %s for writing\n", names[i].c_str());
+            result = 1;
+        }
+    }
+    
+    if (result == 0) {
+        rewind_input(fp1, fp2);
+        std::vector<uint64_t> ordinals(samples, 0);
+        char tag[32];
+        for (size_t i = 0; i < route.size(); i++) {
+            if (read_record(fp1, fp2, rec1, rec2) < 0)
+                break;
+            int sample = route[i];
+            uint64_t ordinal = ordinals[sample]++;
+            bool kept = dedups[sample]->kept(ordinal);
+            FastqWriter *output1 = writers1[sample];
+            FastqWriter *output2 = separateMates ? writers2[sample] : output1;
+            if (settings.mark) {
+                snprintf(tag, sizeof(tag), kept ? " dupset=%u" : " DUP dupset=%u", dedups[sample]->setSizes()[ordinal]);
+                output1->writeTagged(rec1, tag);
+                if (fp2)
+                    output2->writeTagged(rec2, tag);
+            } else if (kept) {
+                output1->writeRecord(rec1);
+                if (fp2)
+                    output2->writeRecord(rec2);
+            }
+        }
+        size_t written = 0;
+        for (size_t i = 0; i < samples; i++)
+            written += ordinals[i];
+        if (written != route.size() || read_record(fp1, fp2, rec1, rec2) != -1) {
+            fprintf(stderr, "ERROR: the input changed while it was read\n");
+            result = 2;
+        }
+    }
+    
+    for (size_t i = 0; i < writers1.size(); i++) {
+        bool written = writers1[i]->close();
+        written = (!writers2[i] || writers2[i]->close()) && written;
+        if (result == 0 && !written) {
+            fprintf(stderr, "ERROR: could not write the output of sample %s\n", names[i].c_str());
+            result = 1;
+        }
+        delete writers1[i];
+        delete writers2[i];
+    }
+    for (size_t i = 0; i < samples; i++)
+        delete dedups[i];
+    return result;
+}
+
+/* Number of distinct molecules in a library from which n reads with d
+ distinct ones were drawn, if every read picks a molecule at random:
+ d = C (1 - e^(-n/C)) solved for C, as by Picard's library complexity
+ estimate. Returns 0 if the reads have no duplicates. */
+double library_size (double n, double d) {
+    if (d <= 0 || d >= n)
+        return 0;
+    // the expected number of distinct reads grows with C towards n
+    double lower = d, upper = 2 * d;
+    while (upper * (1 - exp(-n / upper)) < d)
+        upper *= 2;
+    for (int i = 0; i < 100 && upper - lower > 0.5; i++) {
+        double c = (lower + upper) / 2;
+        if (c * (1 - exp(-n / c)) < d)
+            lower = c;
+        else
+            upper = c;
+    }
+    return (lower + upper) / 2;
 }
 
 int main(int argc, char *argv[])
 {
     std::string name;
     bool gzip;
+    bool zstd;
+    int zstdLevel;
+    bool mark;
+    bool interleaved;
+    std::string shardSpec;
+    std::vector<std::string> mergeFiles;
+    bool estimate;
+    long sampleReads;
+    std::string duplicatesFile;
+    int bloomMB;
+    std::string engine;
+    int threads;
+    bool hugePages;
+    bool tlbStats;
+    std::string batchFile;
+    std::string barcodeFile;
+    std::vector<std::string> indexFiles;
+    int barcodeMismatches;
+    std::string checkpointFile;
+    int checkpointInterval;
+    bool resume;
 
     std::string input1file, input2file;
     
@@ -134,8 +658,72 @@ int main(int argc, char *argv[])
         TCLAP::SwitchArg gzipSwitch("z","gzip","Compress output", false);
         cmd.add( gzipSwitch );
         
-        TCLAP::UnlabeledValueArg<std::string> input1arg("file1.fq[.gz]", "FastQ file (optionally gzip compressed) to be filtered", true, "", "file1.fq[.gz]", cmd);
-        TCLAP::UnlabeledValueArg<std::string> input2arg("file2.fq[.gz]", "FastQ file (optionally gzip compressed) with paired reads to file 1", false, "", "file2.fq[.gz]", cmd);
+        TCLAP::SwitchArg zstdSwitch("","zstd","Compress output with Zstandard", false);
+        cmd.add( zstdSwitch );
+        
+        TCLAP::ValueArg<int> zstdLevelArg("","zstd-level","Zstandard compression level",false,3,"level");
+        cmd.add( zstdLevelArg );
+        
+        TCLAP::SwitchArg markSwitch("","mark","Keep all reads and tag their headers with the size of their duplicate set (dupset=N), and the reads that would be removed with DUP", false);
+        cmd.add( markSwitch );
+        
+        TCLAP::ValueArg<std::string> duplicatesArg("","duplicates-out","Also write the removed reads to this file, compressed like the output",false,"","file");
+        cmd.add( duplicatesArg );
+        
+        TCLAP::ValueArg<int> bloomArg("b","bloom","Memory (MB) for a Bloom filter pre-pass that keeps reads seen only once out of the hash table (0 = off)",false,0,"MB");
+        cmd.add( bloomArg );
+        
+        TCLAP::ValueArg<std::string> engineArg("e","engine","Deduplication engine: 'hash' (hash table) or 'sort' (radix sort of all fingerprints, sequential memory access)",false,"hash","hash|sort");
+        cmd.add( engineArg );
+        
+        TCLAP::ValueArg<int> threadsArg("t","threads","Number of threads for the sort engine and zstd compression (0 = all cores)",false,0,"threads");
+        cmd.add( threadsArg );
+        
+        TCLAP::SwitchArg noHugePagesSwitch("","no-hugepages","Back the hash table with normal pages on the local NUMA node only", false);
+        cmd.add( noHugePagesSwitch );
+        
+        TCLAP::SwitchArg tlbStatsSwitch("","tlb-stats","Report data TLB misses of the fingerprint pass on stderr", false);
+        cmd.add( tlbStatsSwitch );
+        
+        TCLAP::SwitchArg interleavedSwitch("i","interleaved","Paired-end input in a single file, mates in consecutive records; the output is interleaved the same way", false);
+        cmd.add( interleavedSwitch );
+        
+        TCLAP::ValueArg<std::string> shardArg("","shard","Only deduplicate the reads whose fingerprint falls into partition i of N (sort engine), and write the numbers of the kept reads to <prefix>.<i>.keep for --merge",false,"","i/N");
+        cmd.add( shardArg );
+        
+        TCLAP::MultiArg<std::string> mergeArg("","merge","Write the reads kept by a sharded run, given the keep-lists of all its shards",false,"file.keep");
+        cmd.add( mergeArg );
+        
+        TCLAP::SwitchArg estimateSwitch("","estimate","Only estimate the number of distinct reads and the duplication rate in one pass with constant memory", false);
+        cmd.add( estimateSwitch );
+        
+        TCLAP::ValueArg<long> sampleArg("","sample","With --estimate, only look at the first n reads (0 = all) and extrapolate the duplication rate of the whole input from them, assuming the reads are in random order",false,0,"n");
+        cmd.add( sampleArg );
+        
+        TCLAP::ValueArg<std::string> batchArg("","batch","Deduplicate many samples in one process on a shared pool of -t threads; each line of the manifest names a sample and its one or two FastQ files, written to <prefix><sample>.fastq",true,"","manifest");
+        
+        TCLAP::ValueArg<std::string> barcodesArg("","barcodes","Demultiplex while deduplicating: each line of the sheet names a sample and its barcode (i7+i5 for dual indexes); the reads of each sample are deduplicated separately and written to <prefix><sample>.fastq, unmatched ones to <prefix>undetermined.fastq",false,"","sheet");
+        cmd.add( barcodesArg );
+        
+        TCLAP::MultiArg<std::string> indexArg("","index","With --barcodes, take the index sequence from this index FastQ file (give i7, then i5) instead of the read headers",false,"index.fq");
+        cmd.add( indexArg );
+        
+        TCLAP::ValueArg<int> mismatchesArg("","barcode-mismatches","Mismatches allowed in each index read (i7 and i5 separately); sequences that would match two samples stay undetermined",false,0,"n");
+        cmd.add( mismatchesArg );
+        
+        TCLAP::ValueArg<std::string> checkpointArg("","checkpoint","Periodically save the state of the fingerprint pass to this file, written in the background; removed when the run completes",false,"","file");
+        cmd.add( checkpointArg );
+        
+        TCLAP::ValueArg<int> checkpointIntervalArg("","checkpoint-interval","Seconds between checkpoints",false,300,"seconds");
+        cmd.add( checkpointIntervalArg );
+        
+        TCLAP::SwitchArg resumeSwitch("","resume","Continue from the --checkpoint file if there is one, instead of starting over", false);
+        cmd.add( resumeSwitch );
+        
+        // either the input files or a --batch manifest
+        TCLAP::UnlabeledValueArg<std::string> input1arg("file1.fq[.gz]", "FastQ file (optionally gzip or zstd compressed) to be filtered, '-' for standard input", true, "", "file1.fq[.gz]");
+        cmd.xorAdd( input1arg, batchArg );
+        TCLAP::UnlabeledValueArg<std::string> input2arg("file2.fq[.gz]", "FastQ file (optionally gzip or zstd compressed) with paired reads to file 1", false, "", "file2.fq[.gz]", cmd);
 
         // Parse the argv array.
         cmd.parse( argc, argv );
@@ -143,240 +731,395 @@ int main(int argc, char *argv[])
         // Get the value parsed by each arg.
         name = nameArg.getValue();
         gzip = gzipSwitch.getValue();
+        zstd = zstdSwitch.getValue();
+        zstdLevel = zstdLevelArg.getValue();
+        mark = markSwitch.getValue();
+        interleaved = interleavedSwitch.getValue();
+        shardSpec = shardArg.getValue();
+        mergeFiles = mergeArg.getValue();
+        estimate = estimateSwitch.getValue();
+        sampleReads = sampleArg.getValue();
+        duplicatesFile = duplicatesArg.getValue();
+        bloomMB = bloomArg.getValue();
+        engine = engineArg.getValue();
+        threads = threadsArg.getValue();
+        hugePages = !noHugePagesSwitch.getValue();
+        tlbStats = tlbStatsSwitch.getValue();
+        batchFile = batchArg.getValue();
+        barcodeFile = barcodesArg.getValue();
+        indexFiles = indexArg.getValue();
+        barcodeMismatches = mismatchesArg.getValue();
+        checkpointFile = checkpointArg.getValue();
+        checkpointInterval = checkpointIntervalArg.getValue();
+        resume = resumeSwitch.getValue();
         input1file = input1arg.getValue();
         input2file = input2arg.getValue();
     } catch (TCLAP::ArgException &e)  // catch any exceptions
-    { std::cerr << "ERROR: " << e.error() << " for arg " << e.argId() << std::endl; }
+    {
+        std::cerr << "ERROR: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
 
-    uint32_t seed = rand(); // random hash seed
+    if (engine != "hash" && engine != "sort") {
+        fprintf(stderr, "ERROR: unknown engine '%s', expected 'hash' or 'sort'\n", engine.c_str());
+        return 1;
+    }
+    bool sortEngine = engine == "sort";
     
-    gzFile fp1, fp2;
-    kseq_t *seq1, *seq2;
+    unsigned shard = 0, shards = 0;
+    bool merging = !mergeFiles.empty();
+    if (shardSpec != "") {
+        char extra;
+        if (sscanf(shardSpec.c_str(), "%u/%u%c", &shard, &shards, &extra) != 2 || shard >= shards) {
+            fprintf(stderr, "ERROR: invalid shard '%s', expected i/N with 0 <= i < N\n", shardSpec.c_str());
+            return 1;
+        }
+        if (name == "") {
+            fprintf(stderr, "ERROR: --shard needs a prefix (-p) for its keep-list\n");
+            return 1;
+        }
+        if (merging || mark || duplicatesFile != "") {
+            fprintf(stderr, "ERROR: --shard only writes a keep-list; use --merge, --mark and --duplicates-out in the merge step\n");
+            return 1;
+        }
+        sortEngine = true;
+    }
+    if (merging && mark) {
+        fprintf(stderr, "ERROR: --mark needs the duplicate sets and cannot be combined with --merge\n");
+        return 1;
+    }
     
-    int l1, l2;
-
-    fp1 = gzopen(input1file.c_str(), "r");
-    seq1 = kseq_init(fp1);
+    bool batch = batchFile != "";
+    if (batch && (shardSpec != "" || merging || estimate || duplicatesFile != "" || tlbStats)) {
+        fprintf(stderr, "ERROR: --batch takes its input files from the manifest and cannot be combined with --shard, --merge, --estimate, --duplicates-out or --tlb-stats\n");
+        return 1;
+    }
+    bool demultiplexing = barcodeFile != "";
+    if (demultiplexing && (batch || shardSpec != "" || merging || estimate || duplicatesFile != "" || bloomMB > 0)) {
+        fprintf(stderr, "ERROR: --barcodes cannot be combined with --batch, --shard, --merge, --estimate, --duplicates-out or --bloom\n");
+        return 1;
+    }
+    if (!indexFiles.empty() && (!demultiplexing || indexFiles.size() > 2)) {
+        fprintf(stderr, "ERROR: --index needs --barcodes and takes at most two files (i7 and i5)\n");
+        return 1;
+    }
+    bool checkpointing = checkpointFile != "";
+    if (resume && !checkpointing) {
+        fprintf(stderr, "ERROR: --resume needs the --checkpoint file to resume from\n");
+        return 1;
+    }
+    if (checkpointing && (batch || demultiplexing || merging || estimate || input1file == "-" || input2file == "-")) {
+        fprintf(stderr, "ERROR: --checkpoint needs input files other than standard input and cannot be combined with --batch, --barcodes, --merge or --estimate\n");
+        return 1;
+    }
     
-    if (input2file != "") {
-        fp2 = gzopen(input2file.c_str(), "r");
-        seq2 = kseq_init(fp2);
+    if (interleaved && input2file != "") {
+        fprintf(stderr, "ERROR: interleaved input takes a single file\n");
+        return 1;
     }
-    else
-    {
-        fp2 = NULL;
-        seq2 = NULL;
+    
+    if (gzip && zstd) {
+        fprintf(stderr, "ERROR: --gzip and --zstd are mutually exclusive\n");
+        return 1;
     }
-    bool hasName = name != "";
+#ifndef HAVE_ZSTD
+    if (zstd) {
+        fprintf(stderr, "ERROR: sequniq was built without zstd support\n");
+        return 1;
+    }
+#endif
+    OutputCompression compression = gzip ? OUTPUT_GZIP : zstd ? OUTPUT_ZSTD : OUTPUT_PLAIN;
     
-    std::unordered_map<MurmurHash128, OffsetPair> hashtable;
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
 
-    long lastOffset1 = 0;
-    long lastOffset2 = 0;
-    
-    char *newChar = NULL;
-    while ((l1 = kseq_read(seq1)) >= 0) {
-        //calculate the hash function and print
-        uint64_t *hashKey = new uint64_t[sizeof(uint64_t)*2];
-        MurmurHash128 mh;
-        OffsetPair op;
-        
-        if (fp2)
-        {
-            if ((l2 = kseq_read(seq2)) >= 0)
-            {
-                if (sizeof(newChar) < (strlen(seq1->seq.s) + strlen(seq2->seq.s) + 1))
-                {
-                    free(newChar);
-                    newChar = NULL;
-                }
-
-                if (!newChar) {
-                    newChar = new char[strlen(seq1->seq.s) + strlen(seq2->seq.s) + 1];
-                }
-
-                strcpy(newChar, seq1->seq.s);
-                strcat(newChar, seq2->seq.s);
-                murmur(newChar, (int)strlen(newChar), seed, hashKey);
-            }
-            else
-            {
-                fprintf(stderr, "ERROR: paired-end files have different length");
-                return 2;
-            }
-            
-            op.offset1 = lastOffset1;
-            op.offset2 = lastOffset2;
-
-            lastOffset1 = (gztell(fp1) - seq1->f->end) + seq1->f->begin;
-            lastOffset2 = (gztell(fp2) - seq2->f->end) + seq2->f->begin;
-            
-            op.qual = op.qual = calculate_score(seq1->qual.s) + calculate_score(seq2->qual.s);
-        }
-        else
-        {
-            murmur(seq1->seq.s, (int)seq1->seq.l, seed, hashKey);
-            op.offset1 = lastOffset1;
-            lastOffset1 = (gztell(fp1) - seq1->f->end) + seq1->f->begin;
-            
-            op.qual = calculate_score(seq1->qual.s);
+    uint32_t seed = shards ? SHARD_SEED : rand(); // random hash seed
+    
+    DedupOptions options;
+    options.engine = sortEngine || merging ? ENGINE_SORT : ENGINE_HASH;
+    options.threads = threads;
+    options.arenaFlags = hugePages ? ARENA_DEFAULT : 0;
+    options.seed = seed;
+    options.bloomBytes = merging ? 0 : (size_t)bloomMB << 20;
+    options.shard = shard;
+    options.shards = shards;
+    options.countSets = mark;
+    
+    CheckpointHeader checkpoint;
+    bool resuming = false;
+    if (checkpointing) {
+        // checkpoints are written by a fork()ed child
+        options.arenaFlags |= ARENA_FORKABLE;
+        checkpoint_options(&checkpoint, options);
+        checkpoint.inputBytes[0] = file_size(input1file);
+        checkpoint.inputBytes[1] = input2file != "" ? file_size(input2file) : 0;
+        checkpoint.offset[0] = checkpoint.offset[1] = 0;
+    }
+    if (resume && access(checkpointFile.c_str(), F_OK) == 0) {
+        CheckpointHeader saved;
+        if (!read_checkpoint_header(checkpointFile.c_str(), &saved)) {
+            fprintf(stderr, "ERROR: %s is not a checkpoint\n", checkpointFile.c_str());
+            return 1;
         }
-        
-        mh.p = hashKey;
-        mh.size = 2;
-        
-        if (hashtable.count(mh)) {
-            OffsetPair oldOP = hashtable.at(mh);
-            if (oldOP.qual < op.qual)
-                hashtable[mh] = op;
-        } else {
-            hashtable[mh] = op;
+        if (!checkpoint_matches(saved, options) ||
+            saved.inputBytes[0] != checkpoint.inputBytes[0] || saved.inputBytes[1] != checkpoint.inputBytes[1]) {
+            fprintf(stderr, "ERROR: %s was written for other input files or options\n", checkpointFile.c_str());
+            return 1;
         }
+        // the fingerprints must not change half way through
+        options.seed = checkpoint.seed = saved.seed;
+        resuming = true;
     }
-    free(newChar);
     
-    FILE *output1 = stdout;
-    FILE *output2 = NULL;
+    if (batch) {
+        std::vector<BatchSample> samples;
+        if (!read_manifest(batchFile.c_str(), samples))
+            return 1;
+        BatchSettings settings;
+        settings.prefix = name;
+        settings.interleaved = interleaved;
+        settings.mark = mark;
+        settings.bloom = bloomMB > 0;
+        settings.compression = compression;
+        settings.zstdLevel = zstdLevel;
+        // samples run in parallel, so each sorts on its own thread
+        options.threads = 1;
+        return run_batch(samples, settings, options, threads);
+    }
     
-    if (hasName) {
-        std::string outfileName;
-        
-        if (fp2)
-            outfileName = name + "_1.fastq";
-        else
-            outfileName = outfileName + ".fastq";
-        
-        if (gzip)
-            outfileName.append(".gz");
-
-        output1 = fopen(outfileName.c_str(), "w");
-        
-        if (fp2)
-            outfileName = name + "_2.fastq";
-        
-        if (gzip)
-            outfileName.append(".gz");
+    FastqReader reader1, reader2;
+    FastqReader *fp1 = &reader1;
+    FastqReader *fp2 = NULL;
+    FastqRecord rec1, rec2;
+    
+    int l1;
 
-        output2 = fopen(outfileName.c_str(), "w");
+    if (!reader1.open(input1file.c_str())) {
+        fprintf(stderr, "ERROR: could not open %s\n", input1file.c_str());
+        return 1;
     }
     
-    const int OUTBUFLEN = 262144;
-    char *writeBuf1 = new char[sizeof(char)*OUTBUFLEN]; // 1MB output buffer
-    char *writeBuf2 = NULL;
-    if (fp2 && hasName) {
-        writeBuf2 = new char[sizeof(char)*OUTBUFLEN]; // 1MB output buffer
+    if (input2file != "") {
+        if (!reader2.open(input2file.c_str())) {
+            fprintf(stderr, "ERROR: could not open %s\n", input2file.c_str());
+            return 1;
+        }
+        fp2 = &reader2;
+    } else if (interleaved) {
+        fp2 = &reader1;
     }
-    char *strBuf =new char[sizeof(char) * 4096]; // 4000 chars line buf
-
-    for(std::unordered_map<MurmurHash128, OffsetPair>::iterator iterator = hashtable.begin(); iterator != hashtable.end(); iterator++) {
-        OffsetPair offsets = iterator->second;
-        
-        gzseek(fp1, offsets.offset1, SEEK_SET);
-        seq1->last_char = 0;
-        seq1->f->begin=0;
-        seq1->f->end=0;
-        seq1->f->is_eof=0;
-        
-        if ((l1 = kseq_read(seq1)) >= 0) {
-            sprintf(strBuf, "@%s\n%s\n+\n%s\n", seq1->name.s, seq1->seq.s, seq1->qual.s);
+    bool hasName = name != "";
+    
+    if (demultiplexing) {
+        BarcodeSheet sheet;
+        if (!sheet.load(barcodeFile.c_str(), barcodeMismatches))
+            return 1;
+        // route numbers are 16 bits, one is taken by the undetermined reads
+        if (sheet.samples() >= UINT16_MAX) {
+            fprintf(stderr, "ERROR: %s has more than %d samples\n", barcodeFile.c_str(), UINT16_MAX - 1);
+            return 1;
+        }
+        std::vector<FastqReader *> indexReaders;
+        int result = 0;
+        for (size_t i = 0; i < indexFiles.size(); i++) {
+            indexReaders.push_back(new FastqReader);
+            if (result == 0 && !indexReaders[i]->open(indexFiles[i].c_str())) {
+                fprintf(stderr, "ERROR: could not open %s\n", indexFiles[i].c_str());
+                result = 1;
+            }
+        }
+        BatchSettings settings;
+        settings.prefix = name;
+        settings.interleaved = interleaved;
+        settings.mark = mark;
+        settings.bloom = false;
+        settings.compression = compression;
+        settings.zstdLevel = zstdLevel;
+        if (result == 0)
+            result = demultiplex(fp1, fp2, indexReaders, sheet, settings, options);
+        for (size_t i = 0; i < indexReaders.size(); i++)
+            delete indexReaders[i];
+        return result;
+    }
+    
+    if (estimate) {
+        HyperLogLog distinct;
+        std::string pairBuf;
+        uint64_t fingerprint[2];
+        long reads = 0;
+        while ((sampleReads <= 0 || reads < sampleReads) &&
+               (l1 = read_record(fp1, fp2, rec1, rec2)) >= 0) {
+            Deduplicator::fingerprint(rec1, fp2 ? &rec2 : NULL, seed, fingerprint, pairBuf);
+            distinct.add(fingerprint);
+            reads++;
+        }
+        if (l1 < -1) {
+            report_input_error(l1, "");
+            return 2;
         }
         
-        if (strlen(writeBuf1) + strlen(strBuf) < OUTBUFLEN) {
-            strcat(writeBuf1, strBuf);
+        double estimated = std::min(distinct.estimate(), (double)reads);
+        const char *unit = fp2 ? "read pairs" : "reads";
+        if (l1 == -1 || reads == 0) {
+            printf("%s: %ld\n", unit, reads);
+            printf("distinct (estimated): %.0f\n", estimated);
+            printf("duplication rate (estimated): %.2f%%\n", reads ? 100.0 * (1 - estimated / reads) : 0.0);
+            return 0;
         }
-        else
-        {
-            if (gzip)
-            {
-                compress_to_stream(writeBuf1, output1);
+        
+        // A sample sees fewer duplicates than the whole input, whose distinct
+        // reads follow from the library size; its read count is scaled from
+        // the bytes the sample took up.
+        const FastqRecord &last = fp2 == fp1 ? rec2 : rec1;
+        double total = (double)reads * fp1->estimatedSize() / (last.offset + last.raw.l);
+        total = std::max(total, (double)reads);
+        double molecules = library_size((double)reads, estimated);
+        double extrapolated = molecules > 0 ? molecules * (1 - exp(-total / molecules)) : total;
+        printf("%s in the sample: %ld\n", unit, reads);
+        printf("distinct in the sample (estimated): %.0f\n", estimated);
+        printf("%s (extrapolated): %.0f\n", unit, total);
+        printf("distinct (extrapolated): %.0f\n", extrapolated);
+        printf("duplication rate (extrapolated): %.2f%%\n", 100.0 * (1 - extrapolated / total));
+        return 0;
+    }
+    
+    Deduplicator dedup(options);
+    
+    // with --merge, the keep-lists of the shards replace the fingerprint passes
+    std::vector<bool> mergedKeep;
+    
+    if (merging) {
+        // the shards fingerprint with SHARD_SEED
+        KeepListHeader input;
+        keep_list_input(&input, SHARD_SEED, input1file, input2file);
+        std::vector<bool> seenShard;
+        for (size_t i = 0; i < mergeFiles.size(); i++) {
+            KeepListHeader header;
+            if (!read_keep_list(mergeFiles[i].c_str(), &header, mergedKeep) || !keep_list_same_input(header, input)) {
+                fprintf(stderr, "ERROR: %s is not a keep-list for this input\n", mergeFiles[i].c_str());
+                return 2;
+            }
+            seenShard.resize(header.shards, false);
+            if (header.shards != mergeFiles.size() || header.shard >= header.shards || seenShard[header.shard]) {
+                fprintf(stderr, "ERROR: --merge needs the keep-lists of all %u shards, each once\n", header.shards);
+                return 1;
             }
+            seenShard[header.shard] = true;
+        }
+    } else {
+        if (!dedup.valid()) {
+            if (bloomMB > 0)
+                fprintf(stderr, "ERROR: could not allocate %d MB for the Bloom filter\n", bloomMB);
             else
-            {
-                fputs(writeBuf1, output1);
+                fprintf(stderr, "ERROR: could not allocate the fingerprint table\n");
+            return 2;
+        }
+        
+        if (resuming) {
+            if (!read_checkpoint(checkpointFile.c_str(), &checkpoint, dedup)) {
+                fprintf(stderr, "ERROR: could not read the checkpoint %s\n", checkpointFile.c_str());
+                return 2;
             }
-            
-            strcpy(writeBuf1, strBuf);
-        }
-        
-        if (fp2)
-        {
-            gzseek(fp2, offsets.offset2, SEEK_SET);
-            seq2->last_char = 0;
-            seq2->f->begin=0;
-            seq2->f->end=0;
-            seq2->f->is_eof=0;
-            if ((l2 = kseq_read(seq2)) >= 0) {
-                sprintf(strBuf, "@%s\n%s\n+\n%s\n", seq2->name.s, seq2->seq.s, seq2->qual.s);
+            if (!fp1->seek(checkpoint.offset[0], true) ||
+                (fp2 && fp2 != fp1 && !fp2->seek(checkpoint.offset[1], true))) {
+                fprintf(stderr, "ERROR: could not continue the input where %s left off\n", checkpointFile.c_str());
+                return 2;
             }
-            
-            char *buf;
-            if (hasName)
-                buf = writeBuf2;
-            else
-                buf = writeBuf1;
-            
-            if (strlen(buf) + strlen(strBuf) < OUTBUFLEN) {
-                strcat(buf, strBuf);
+        } else if (bloomMB > 0) {
+            if ((l1 = feed_reads(fp1, fp2, dedup, true)) != -1) {
+                report_input_error(l1, "");
+                return 2;
             }
+            rewind_input(fp1, fp2);
+        }
+        
+        // only opened on request: perf_event_open is not free and may be logged
+        TlbCounter *tlb = tlbStats ? new TlbCounter : NULL;
+        if (tlb)
+            tlb->start();
+        
+        if (checkpointing)
+            l1 = feed_reads_checkpointed(fp1, fp2, dedup, checkpointFile, checkpoint, checkpointInterval);
+        else
+            l1 = feed_reads(fp1, fp2, dedup, false);
+        if (l1 != -1) {
+            report_input_error(l1, "");
+            delete tlb;
+            return 2;
+        }
+        
+        // the sort engine does most of its work in finish()
+        dedup.finish();
+        
+        if (tlb) {
+            int64_t misses = tlb->stop();
+            if (misses >= 0)
+                fprintf(stderr, "dTLB load misses: %lld (%s)\n", (long long)misses,
+                        sortEngine ? "sort engine" : hugePages ? "huge pages" : "normal pages");
             else
-            {
-                if (gzip)
-                {
-                    compress_to_stream(buf, hasName?output2:output1);
-                }
-                else
-                {
-                    fputs(buf, hasName?output2:output1);
-                }
-                
-                strcpy(buf, strBuf);
-            }
+                fprintf(stderr, "dTLB load misses: not available on this system\n");
+            delete tlb;
         }
     }
+    const std::vector<bool> &keep = merging ? mergedKeep : dedup.keepFlags();
     
-    if (strlen(writeBuf1))
-    {
-        if (gzip)
-        {
-            compress_to_stream(writeBuf1, output1);
-        }
-        else
-        {
-            fputs(writeBuf1, output1);
+    if (shards) {
+        std::string keepFile = name + "." + std::to_string(shard) + ".keep";
+        KeepListHeader header;
+        header.shard = shard;
+        header.shards = shards;
+        keep_list_input(&header, seed, input1file, input2file);
+        if (!write_keep_list(keepFile.c_str(), header, keep)) {
+            fprintf(stderr, "ERROR: could not write %s\n", keepFile.c_str());
+            return 1;
         }
+        if (checkpointing)
+            unlink(checkpointFile.c_str());
+        return 0;
     }
     
-    if (fp2 && hasName)
-    {
-        if (strlen(writeBuf2))
-        {
-            if (gzip)
-            {
-                compress_to_stream(writeBuf2, output2);
-            }
-            else
-            {
-                fputs(writeBuf2, output2);
-            }
+    FastqWriter writer1, writer2;
+    FastqWriter *output1 = &writer1;
+    FastqWriter *output2 = &writer1; // mates are interleaved on stdout
+    
+    std::string outfileName1, outfileName2;
+    if (hasName)
+        output_names(name, fp2 && !interleaved, compression, outfileName1, outfileName2);
+    
+    if (!writer1.open(outfileName1, compression, zstdLevel, threads)) {
+        fprintf(stderr, "ERROR: could not open %s for writing\n", outfileName1.c_str());
+        return 1;
+    }
+    if (fp2 && !interleaved && hasName) {
+        if (!writer2.open(outfileName2, compression, zstdLevel, threads)) {
+            fprintf(stderr, "ERROR: could not open %s for writing\n", outfileName2.c_str());
+            return 1;
         }
+        output2 = &writer2;
     }
     
-    if (hasName) {
-        fclose(output1);
-        
-        if (output2)
-            fclose(output2);
+    FastqWriter duplicateWriter;
+    bool duplicates = duplicatesFile != "";
+    if (duplicates && !duplicateWriter.open(duplicatesFile, compression, zstdLevel, threads)) {
+        fprintf(stderr, "ERROR: could not open %s for writing\n", duplicatesFile.c_str());
+        return 1;
+    }
+    
+    // the keep flags are in input order, so a single sequential pass suffices
+    rewind_input(fp1, fp2);
+    if (!write_output(fp1, fp2, keep, dedup.setSizes(), mark, output1, output2, duplicates ? &duplicateWriter : NULL)) {
+        fprintf(stderr, "ERROR: %s\n", merging ? "the input does not match the keep-lists" : "the input changed while it was read");
+        return 2;
     }
     
-    free(writeBuf1);
-    if (writeBuf2)
-        free(writeBuf2);
-    free(strBuf);
-    kseq_destroy(seq1);
-    kseq_destroy(seq2);
-    gzclose(fp1);
-    gzclose(fp2);
+    bool written = writer1.close();
+    written = writer2.close() && written;
+    written = duplicateWriter.close() && written;
+    if (!written) {
+        fprintf(stderr, "ERROR: could not write the output\n");
+        return 1;
+    }
+    if (checkpointing)
+        unlink(checkpointFile.c_str());
     return 0;
 }
-
-